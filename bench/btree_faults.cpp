@@ -0,0 +1,95 @@
+/*-------------------------------------------------------
+
+    Page fault cost of BTreeSet against a frozen set
+    Builds the same keys as a BTreeSet file and as a frozen
+    sorted array file, then runs random lookups on both: the
+    tree through its buffer pool, the array by binary search
+    over a read-only mmap. Prints page_misses() of the tree
+    next to the faults the kernel counted for the mapping
+
+    g++ -std=c++17 -O2 -I.. btree_faults.cpp -o btree_faults
+    ./btree_faults [keys] [lookups] [pool pages]
+
+-------------------------------------------------------*/
+
+#include "../btree_set.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+static long faults() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    size_t keys = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    size_t lookups = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+    size_t poolPages = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 64;
+
+    std::string dir = "/tmp/btree_faults." + std::to_string(getpid());
+    std::string treePath = dir + ".tree", frozenPath = dir + ".frozen";
+
+    {
+        BTreeSet<uint64_t> tree(treePath, 1024);
+        std::vector<uint64_t> sorted(keys);
+        for (uint64_t i = 0; i < keys; ++i) {
+            tree.insert(i * 2);
+            sorted[i] = i * 2;
+        }
+        FILE* out = std::fopen(frozenPath.c_str(), "wb");
+        if (!out || std::fwrite(sorted.data(), sizeof(uint64_t), keys, out) != keys || std::fclose(out) != 0) {
+            std::perror(frozenPath.c_str());
+            return 1;
+        }
+    }
+
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> probes(lookups);
+    for (uint64_t& probe : probes)
+        probe = rng() % (keys * 2);
+
+    size_t found = 0;
+    BTreeSet<uint64_t> tree(treePath, poolPages);
+    auto start = std::chrono::steady_clock::now();
+    long before = faults();
+    for (uint64_t probe : probes)
+        found += tree.contains(probe);
+    std::printf("btree   %zu pool pages: %.3f s, %zu page misses, %ld faults\n",
+                poolPages, seconds(start), tree.page_misses(), faults() - before);
+
+    size_t bytes = keys * sizeof(uint64_t);
+    int fd = open(frozenPath.c_str(), O_RDONLY);
+    void* place = fd >= 0 && bytes ? mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (place == MAP_FAILED) {
+        std::perror(frozenPath.c_str());
+        return 1;
+    }
+    close(fd);
+    const uint64_t* frozen = static_cast<const uint64_t*>(place);
+    start = std::chrono::steady_clock::now();
+    before = faults();
+    for (uint64_t probe : probes)
+        found += std::binary_search(frozen, frozen + keys, probe);
+    std::printf("frozen  %zu bytes: %.3f s, %ld faults\n", bytes, seconds(start), faults() - before);
+    munmap(place, bytes);
+
+    std::printf("%zu hits\n", found);
+    unlink(treePath.c_str());
+    unlink(frozenPath.c_str());
+}
@@ -0,0 +1,635 @@
+/*-------------------------------------------------------
+
+    Disk resident ordered set based on B+ tree
+    Nodes are fixed size pages of a single file, accessed
+    through a buffer pool of configurable size with clock
+    eviction. Keys must be trivially copyable
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*-------------------------------------------------------
+    Buffer pool
+-------------------------------------------------------*/
+
+class BufferPool {
+public:
+    static constexpr size_t kPageSize = 4096;
+
+    struct Frame {
+        alignas(8) char data[kPageSize];
+        uint64_t page = 0;
+        size_t pins = 0;
+        bool dirty = false, referenced = false, used = false;
+    };
+
+    // Keeps the frame pinned while alive
+    class PageRef {
+    public:
+        explicit PageRef(Frame* frame) : frame(frame) {}
+        PageRef(const PageRef&) = delete;
+        PageRef& operator=(const PageRef&) = delete;
+
+        PageRef(PageRef&& other) noexcept : frame(other.frame) {
+            other.frame = nullptr;
+        }
+
+        ~PageRef() {
+            if (frame)
+                --frame->pins;
+        }
+
+        template<typename T>
+        T* as() const {
+            return reinterpret_cast<T*>(frame->data);
+        }
+
+        uint64_t page() const {
+            return frame->page;
+        }
+
+        void markDirty() const {
+            frame->dirty = true;
+        }
+
+    private:
+        Frame* frame;
+    };
+
+    BufferPool(const std::string& path, size_t cachePages);
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    ~BufferPool();
+
+    PageRef fetch(uint64_t page);
+
+    // Appends a zeroed page to the file
+    PageRef allocate();
+
+    // Writes back every dirty frame
+    void flush();
+
+    uint64_t pages() const;
+
+    // Pages read from the file since construction
+    size_t misses() const;
+
+private:
+    static void check(bool ok, const char* what) {
+        if (!ok)
+            throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    void readPage(Frame& frame) {
+        char* bytes = frame.data;
+        size_t length = kPageSize;
+        off_t offset = off_t(frame.page) * kPageSize;
+        while (length) {
+            ssize_t got = ::pread(fd, bytes, length, offset);
+            check(got > 0 || (got < 0 && errno == EINTR), "pread");
+            if (got <= 0)
+                continue;
+            bytes += got;
+            length -= got;
+            offset += got;
+        }
+        ++missCount;
+    }
+
+    void writePage(Frame& frame) {
+        const char* bytes = frame.data;
+        size_t length = kPageSize;
+        off_t offset = off_t(frame.page) * kPageSize;
+        while (length) {
+            ssize_t written = ::pwrite(fd, bytes, length, offset);
+            check(written >= 0 || errno == EINTR, "pwrite");
+            if (written <= 0)
+                continue;
+            bytes += written;
+            length -= written;
+            offset += written;
+        }
+        frame.dirty = false;
+    }
+
+    // Clock sweep over unpinned frames, writing back the victim if dirty
+    Frame& victim() {
+        for (size_t step = 0; step < 2 * frames.size() + 1; ++step) {
+            Frame& frame = frames[hand];
+            hand = (hand + 1) % frames.size();
+            if (frame.pins)
+                continue;
+            if (frame.referenced) {
+                frame.referenced = false;
+                continue;
+            }
+            if (frame.used) {
+                if (frame.dirty)
+                    writePage(frame);
+                table.erase(frame.page);
+            }
+            return frame;
+        }
+        throw std::runtime_error("BufferPool: every frame is pinned");
+    }
+
+    Frame& take(uint64_t page) {
+        Frame& frame = victim();
+        frame.page = page;
+        frame.pins = 1;
+        frame.used = frame.referenced = true;
+        frame.dirty = false;
+        table[page] = &frame - frames.data();
+        return frame;
+    }
+
+    //---------------------------------------------------
+
+    int fd = -1;
+    uint64_t pageCount = 0;
+    std::vector<Frame> frames;
+    std::unordered_map<uint64_t, size_t> table;  // page -> frame
+    size_t hand = 0;
+    size_t missCount = 0;
+};
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+template <typename ValueType>
+class BTreeSet {
+    static_assert(std::is_trivially_copyable<ValueType>::value, "pages store raw keys");
+    static_assert(alignof(ValueType) <= 8, "keys are laid out after 8-byte aligned headers");
+
+    using PageRef = BufferPool::PageRef;
+
+public:
+    //---------------------------------------------------
+    // constructors & destructor
+
+    // Opens the tree stored in path or creates an empty one,
+    // cachePages is the size of the buffer pool
+    explicit BTreeSet(const std::string& path, size_t cachePages = 256);
+
+    BTreeSet(const BTreeSet&) = delete;
+    BTreeSet& operator=(const BTreeSet&) = delete;
+
+    ~BTreeSet();
+
+    //---------------------------------------------------
+    // Methods
+
+    size_t size() const;
+
+    bool empty() const;
+
+    void insert(const ValueType& value);
+
+    // Leaves are not merged, an emptied leaf stays in the chain
+    void erase(const ValueType& value);
+
+    // Writes the dirty pages and the header back to the file
+    void flush();
+
+    // Pages read from the file, a proxy for page faults
+    size_t page_misses() const;
+
+    //---------------------------------------------------
+    // iterators
+
+    class iterator {
+    public:
+        iterator() = default;
+        iterator(const BTreeSet<ValueType>* parent, uint64_t leaf, size_t slot);
+
+        iterator& operator++();      // ++it
+        iterator operator++(int);    // it++
+
+        const ValueType& operator*() const;
+        const ValueType* operator->() const;
+
+        bool operator==(const iterator& other) const;
+        bool operator!=(const iterator& other) const;
+
+    private:
+        // Moves past exhausted leaves and loads the key
+        void settle();
+
+        const BTreeSet<ValueType>* parent = nullptr;
+        uint64_t leaf = 0;  // 0 is the header page and marks the end
+        size_t slot = 0;
+        ValueType key{};
+    };
+
+    iterator begin() const;
+
+    iterator end() const;
+
+    //---------------------------------------------------
+    // Search methods
+
+    iterator find(const ValueType& key) const;
+
+    iterator lower_bound(const ValueType& key) const;
+
+    bool contains(const ValueType& key) const;
+
+private:
+    //---------------------------------------------------
+    // Page layout
+
+    static constexpr uint64_t kMagic = 0x5445455254425641;  // "AVBTREET"
+
+    struct Header {
+        uint64_t magic;
+        uint64_t keySize;
+        uint64_t root;
+        uint64_t count;
+    };
+
+    struct NodeHeader {
+        uint32_t leaf;
+        uint32_t count;
+        uint64_t next;  // right sibling of a leaf
+    };
+
+    static constexpr size_t kPageSize = BufferPool::kPageSize;
+    static constexpr size_t kLeafKeys = (kPageSize - sizeof(NodeHeader)) / sizeof(ValueType);
+    static constexpr size_t kInnerKeys = (kPageSize - sizeof(NodeHeader) - sizeof(uint64_t)) / (sizeof(ValueType) + sizeof(uint64_t));
+    static_assert(kInnerKeys >= 3, "keys are too large for a page");
+
+    // Inner node i covers keys in [keys[i - 1], keys[i])
+    static uint64_t* children(const PageRef& ref) {
+        return reinterpret_cast<uint64_t*>(ref.as<char>() + sizeof(NodeHeader));
+    }
+
+    static ValueType* keys(const PageRef& ref) {
+        NodeHeader* node = ref.as<NodeHeader>();
+        size_t offset = sizeof(NodeHeader) + (node->leaf ? 0 : (kInnerKeys + 1) * sizeof(uint64_t));
+        return reinterpret_cast<ValueType*>(ref.as<char>() + offset);
+    }
+
+    static size_t lowerIndex(const PageRef& ref, const ValueType& key) {
+        ValueType* begin = keys(ref);
+        return std::lower_bound(begin, begin + ref.as<NodeHeader>()->count, key) - begin;
+    }
+
+    static size_t childIndex(const PageRef& ref, const ValueType& key) {
+        ValueType* begin = keys(ref);
+        return std::upper_bound(begin, begin + ref.as<NodeHeader>()->count, key) - begin;
+    }
+
+    //---------------------------------------------------
+    // Methods
+
+    PageRef newNode(bool leaf) {
+        PageRef ref = pool.allocate();
+        NodeHeader* node = ref.as<NodeHeader>();
+        node->leaf = leaf;
+        node->count = 0;
+        node->next = 0;
+        return ref;
+    }
+
+    // Leaf that would hold key
+    uint64_t findLeaf(const ValueType& key) const {
+        uint64_t page = root;
+        for (;;) {
+            PageRef ref = pool.fetch(page);
+            if (ref.as<NodeHeader>()->leaf)
+                return page;
+            page = children(ref)[childIndex(ref, key)];
+        }
+    }
+
+    struct Split {
+        ValueType key;
+        uint64_t page;
+    };
+
+    // Returns true and fills split when the node had to be split in two
+    bool insertInto(uint64_t page, const ValueType& key, bool& inserted, Split& split) {
+        PageRef ref = pool.fetch(page);
+        NodeHeader* node = ref.as<NodeHeader>();
+
+        if (node->leaf) {
+            size_t pos = lowerIndex(ref, key);
+            if (pos < node->count && !(key < keys(ref)[pos]))
+                return inserted = false;
+            inserted = true;
+            ref.markDirty();
+
+            std::vector<ValueType> items(keys(ref), keys(ref) + node->count);
+            items.insert(items.begin() + pos, key);
+            if (items.size() <= kLeafKeys) {
+                std::copy(items.begin(), items.end(), keys(ref));
+                node->count = items.size();
+                return false;
+            }
+
+            PageRef right = newNode(true);
+            size_t half = items.size() / 2;
+            std::copy(items.begin(), items.begin() + half, keys(ref));
+            std::copy(items.begin() + half, items.end(), keys(right));
+            node->count = half;
+            right.as<NodeHeader>()->count = items.size() - half;
+            right.as<NodeHeader>()->next = node->next;
+            node->next = right.page();
+            split = Split{items[half], right.page()};
+            return true;
+        }
+
+        size_t index = childIndex(ref, key);
+        Split below;
+        if (!insertInto(children(ref)[index], key, inserted, below))
+            return false;
+        ref.markDirty();
+
+        std::vector<ValueType> items(keys(ref), keys(ref) + node->count);
+        std::vector<uint64_t> links(children(ref), children(ref) + node->count + 1);
+        items.insert(items.begin() + index, below.key);
+        links.insert(links.begin() + index + 1, below.page);
+        if (items.size() <= kInnerKeys) {
+            node->count = items.size();
+            std::copy(links.begin(), links.end(), children(ref));
+            std::copy(items.begin(), items.end(), keys(ref));
+            return false;
+        }
+
+        // The middle key moves up instead of being copied
+        PageRef right = newNode(false);
+        size_t half = items.size() / 2;
+        node->count = half;
+        std::copy(links.begin(), links.begin() + half + 1, children(ref));
+        std::copy(items.begin(), items.begin() + half, keys(ref));
+        right.as<NodeHeader>()->count = items.size() - half - 1;
+        std::copy(links.begin() + half + 1, links.end(), children(right));
+        std::copy(items.begin() + half + 1, items.end(), keys(right));
+        split = Split{items[half], right.page()};
+        return true;
+    }
+
+    void writeHeader() {
+        PageRef ref = pool.fetch(0);
+        Header* header = ref.as<Header>();
+        header->magic = kMagic;
+        header->keySize = sizeof(ValueType);
+        header->root = root;
+        header->count = count;
+        ref.markDirty();
+    }
+
+    //---------------------------------------------------
+
+    mutable BufferPool pool;
+    uint64_t root = 0;
+    size_t count = 0;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+inline BufferPool::BufferPool(const std::string& path, size_t cachePages) : frames(std::max<size_t>(cachePages, 8)) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    check(fd >= 0, "open");
+
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        check(false, "fstat");
+    }
+    pageCount = info.st_size / kPageSize;
+}
+
+inline BufferPool::~BufferPool() {
+    try {
+        flush();
+    } catch (...) {
+    }
+    ::close(fd);
+}
+
+inline BufferPool::PageRef BufferPool::fetch(uint64_t page) {
+    auto it = table.find(page);
+    if (it != table.end()) {
+        Frame& frame = frames[it->second];
+        ++frame.pins;
+        frame.referenced = true;
+        return PageRef(&frame);
+    }
+
+    Frame& frame = take(page);
+    try {
+        readPage(frame);
+    } catch (...) {
+        table.erase(page);
+        frame.used = false;
+        frame.pins = 0;
+        throw;
+    }
+    return PageRef(&frame);
+}
+
+inline BufferPool::PageRef BufferPool::allocate() {
+    Frame& frame = take(pageCount++);
+    std::memset(frame.data, 0, kPageSize);
+    frame.dirty = true;
+    return PageRef(&frame);
+}
+
+inline void BufferPool::flush() {
+    for (Frame& frame : frames)
+        if (frame.used && frame.dirty)
+            writePage(frame);
+}
+
+inline uint64_t BufferPool::pages() const {
+    return pageCount;
+}
+
+inline size_t BufferPool::misses() const {
+    return missCount;
+}
+
+template<typename ValueType>
+BTreeSet<ValueType>::BTreeSet(const std::string& path, size_t cachePages) : pool(path, cachePages) {
+    if (pool.pages() == 0) {
+        pool.allocate();
+        root = newNode(true).page();
+        writeHeader();
+        return;
+    }
+
+    PageRef ref = pool.fetch(0);
+    const Header* header = ref.as<Header>();
+    if (header->magic != kMagic || header->keySize != sizeof(ValueType))
+        throw std::runtime_error("BTreeSet: " + path + " is not a tree of this key type");
+    root = header->root;
+    count = header->count;
+}
+
+template<typename ValueType>
+BTreeSet<ValueType>::~BTreeSet() {
+    try {
+        flush();
+    } catch (...) {
+    }
+}
+
+template<typename ValueType>
+size_t BTreeSet<ValueType>::size() const {
+    return count;
+}
+
+template<typename ValueType>
+bool BTreeSet<ValueType>::empty() const {
+    return count == 0;
+}
+
+template<typename ValueType>
+void BTreeSet<ValueType>::insert(const ValueType& value) {
+    bool inserted = false;
+    Split split;
+    if (insertInto(root, value, inserted, split)) {
+        PageRef top = newNode(false);
+        top.as<NodeHeader>()->count = 1;
+        children(top)[0] = root;
+        children(top)[1] = split.page;
+        keys(top)[0] = split.key;
+        root = top.page();
+    }
+    count += inserted;
+}
+
+template<typename ValueType>
+void BTreeSet<ValueType>::erase(const ValueType& value) {
+    PageRef ref = pool.fetch(findLeaf(value));
+    NodeHeader* node = ref.as<NodeHeader>();
+    size_t pos = lowerIndex(ref, value);
+    if (pos == node->count || value < keys(ref)[pos])
+        return;
+
+    std::copy(keys(ref) + pos + 1, keys(ref) + node->count, keys(ref) + pos);
+    --node->count;
+    ref.markDirty();
+    --count;
+}
+
+template<typename ValueType>
+void BTreeSet<ValueType>::flush() {
+    writeHeader();
+    pool.flush();
+}
+
+template<typename ValueType>
+size_t BTreeSet<ValueType>::page_misses() const {
+    return pool.misses();
+}
+
+template<typename ValueType>
+BTreeSet<ValueType>::iterator::iterator(const BTreeSet<ValueType>* parent, uint64_t leaf, size_t slot)
+    : parent(parent), leaf(leaf), slot(slot) {
+    settle();
+}
+
+template<typename ValueType>
+void BTreeSet<ValueType>::iterator::settle() {
+    while (leaf) {
+        PageRef ref = parent->pool.fetch(leaf);
+        const NodeHeader* node = ref.as<NodeHeader>();
+        if (slot < node->count) {
+            key = keys(ref)[slot];
+            return;
+        }
+        leaf = node->next;
+        slot = 0;
+    }
+}
+
+template<typename ValueType>
+typename BTreeSet<ValueType>::iterator& BTreeSet<ValueType>::iterator::operator++() {
+    ++slot;
+    settle();
+    return *this;
+}
+
+template<typename ValueType>
+typename BTreeSet<ValueType>::iterator BTreeSet<ValueType>::iterator::operator++(int) {
+    iterator old(*this);
+    ++*this;
+    return old;
+}
+
+template<typename ValueType>
+const ValueType& BTreeSet<ValueType>::iterator::operator*() const {
+    return key;
+}
+
+template<typename ValueType>
+const ValueType* BTreeSet<ValueType>::iterator::operator->() const {
+    return &key;
+}
+
+template<typename ValueType>
+bool BTreeSet<ValueType>::iterator::operator==(const iterator& other) const {
+    return this->leaf == other.leaf && this->slot == other.slot && this->parent == other.parent;
+}
+
+template<typename ValueType>
+bool BTreeSet<ValueType>::iterator::operator!=(const iterator& other) const {
+    return !(*this == other);
+}
+
+template<typename ValueType>
+typename BTreeSet<ValueType>::iterator BTreeSet<ValueType>::begin() const {
+    uint64_t page = root;
+    for (;;) {
+        PageRef ref = pool.fetch(page);
+        if (ref.as<NodeHeader>()->leaf)
+            return iterator(this, page, 0);
+        page = children(ref)[0];
+    }
+}
+
+template<typename ValueType>
+typename BTreeSet<ValueType>::iterator BTreeSet<ValueType>::end() const {
+    return iterator(this, 0, 0);
+}
+
+template<typename ValueType>
+typename BTreeSet<ValueType>::iterator BTreeSet<ValueType>::find(const ValueType& key) const {
+    iterator it = lower_bound(key);
+    return it != end() && !(key < *it) ? it : end();
+}
+
+template<typename ValueType>
+typename BTreeSet<ValueType>::iterator BTreeSet<ValueType>::lower_bound(const ValueType& key) const {
+    uint64_t leaf = findLeaf(key);
+    size_t slot = lowerIndex(pool.fetch(leaf), key);
+    return iterator(this, leaf, slot);
+}
+
+template<typename ValueType>
+bool BTreeSet<ValueType>::contains(const ValueType& key) const {
+    return find(key) != end();
+}
@@ -0,0 +1,424 @@
+/*-------------------------------------------------------
+
+    Set with a frozen sorted base and a small mutable delta
+    Lookups binary search the base array and consult the
+    delta, writes only touch the delta. Once the delta grows
+    past a fraction of the base it is frozen and merged with
+    the base into a new array on a background thread, while
+    writes go to a fresh delta on top of the frozen one
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <vector>
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+template <typename ValueType>
+class BufferedSet {
+public:
+    //---------------------------------------------------
+    // constructors & destructor
+
+    BufferedSet() = default;
+    template<typename iteratorType>
+    BufferedSet(iteratorType first, iteratorType last);
+    BufferedSet(std::initializer_list<ValueType> init);
+
+    // The background merge keeps a pointer to the set
+    BufferedSet(const BufferedSet&) = delete;
+    BufferedSet& operator=(const BufferedSet&) = delete;
+
+    // Waits for a running merge
+    ~BufferedSet();
+
+    //---------------------------------------------------
+    // Methods
+
+    size_t size() const;
+
+    bool empty() const;
+
+    void clear();
+
+    // Writes install a finished merge and may start the next one,
+    // so they invalidate iterators
+    void insert(const ValueType& value);
+
+    void erase(const ValueType& value);
+
+    // Folds the whole delta into a new base and waits for it
+    void merge();
+
+    // True while a merge runs in the background
+    bool merging() const;
+
+    // Keys inserted or erased since the last finished merge
+    size_t delta_size() const;
+
+    //---------------------------------------------------
+    // iterators
+
+    using SetIterator = typename Set<ValueType>::iterator;
+
+    // Walks a sorted lower layer and a delta side by side,
+    // adding the delta's keys and skipping its tombstones
+    template<typename Lower>
+    class Overlay {
+    public:
+        Overlay() = default;
+        Overlay(Lower lower, SetIterator added, SetIterator addedEnd, SetIterator removed, SetIterator removedEnd);
+
+        bool done() const;
+        const ValueType& get() const;
+        void next();
+
+        bool operator==(const Overlay& other) const;
+
+    private:
+        bool lowerFirst() const;
+        void skipRemoved();
+
+        Lower lower;
+        SetIterator added, addedEnd, removed, removedEnd;
+    };
+
+    // Position in the base array
+    class BaseCursor {
+    public:
+        BaseCursor() = default;
+        BaseCursor(const ValueType* at, const ValueType* end) : at(at), end(end) {}
+
+        bool done() const {
+            return at == end;
+        }
+
+        const ValueType& get() const {
+            return *at;
+        }
+
+        void next() {
+            ++at;
+        }
+
+        bool operator==(const BaseCursor& other) const {
+            return at == other.at;
+        }
+
+    private:
+        const ValueType* at = nullptr;
+        const ValueType* end = nullptr;
+    };
+
+    // The live delta over the frozen one over the base
+    using Frozen = Overlay<BaseCursor>;
+    using Cursor = Overlay<Frozen>;
+
+    class iterator {
+    public:
+        iterator() = default;
+        explicit iterator(Cursor cursor) : cursor(cursor) {}
+
+        iterator& operator++();      // ++it
+        iterator operator++(int);    // it++
+
+        const ValueType& operator*() const;
+        const ValueType* operator->() const;
+
+        bool operator==(const iterator& other) const;
+        bool operator!=(const iterator& other) const;
+
+    private:
+        Cursor cursor;
+    };
+
+    iterator begin() const;
+
+    iterator end() const;
+
+    //---------------------------------------------------
+    // Search methods
+
+    iterator find(const ValueType& key) const;
+
+    iterator lower_bound(const ValueType& key) const;
+
+    bool contains(const ValueType& key) const;
+
+private:
+    static constexpr size_t kMinMergeDelta = 1024;
+    static constexpr size_t kBaseToDelta = 16;
+
+    bool inBase(const ValueType& key) const {
+        auto it = std::lower_bound(base.begin(), base.end(), key);
+        return it != base.end() && !(key < *it);
+    }
+
+    // Membership in the base with the frozen delta applied
+    bool inFrozen(const ValueType& key) const {
+        if (frozenAdded.find(key) != frozenAdded.end())
+            return true;
+        return inBase(key) && frozenRemoved.find(key) == frozenRemoved.end();
+    }
+
+    Frozen frozenBegin() const {
+        return Frozen(BaseCursor(base.data(), base.data() + base.size()), frozenAdded.begin(), frozenAdded.end(),
+                      frozenRemoved.begin(), frozenRemoved.end());
+    }
+
+    // Frozen layer at the first key not below *key, or at the end for nullptr
+    Frozen frozenAt(const ValueType* key) const {
+        size_t index = key ? std::lower_bound(base.begin(), base.end(), *key) - base.begin() : base.size();
+        BaseCursor cursor(base.data() + index, base.data() + base.size());
+        if (!key)
+            return Frozen(cursor, frozenAdded.end(), frozenAdded.end(), frozenRemoved.end(), frozenRemoved.end());
+        return Frozen(cursor, frozenAdded.lower_bound(*key), frozenAdded.end(),
+                      frozenRemoved.lower_bound(*key), frozenRemoved.end());
+    }
+
+    // Installs a finished merge, or waits for it when wait is set
+    void finishMerge(bool wait) {
+        if (!pending.valid())
+            return;
+        if (!wait && pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+        base = pending.get();
+        frozenAdded.clear();
+        frozenRemoved.clear();
+    }
+
+    // Freezes the live delta and merges it with the base on another
+    // thread, which only reads base and the frozen sets
+    void startMerge() {
+        frozenAdded = std::move(added);
+        frozenRemoved = std::move(removed);
+        pending = std::async(std::launch::async, [this] {
+            std::vector<ValueType> merged;
+            merged.reserve(base.size() + frozenAdded.size() - frozenRemoved.size());
+            for (Frozen cursor = frozenBegin(); !cursor.done(); cursor.next())
+                merged.push_back(cursor.get());
+            return merged;
+        });
+    }
+
+    void mergeIfLarge() {
+        finishMerge(false);
+        if (!pending.valid() && added.size() + removed.size() >= std::max(kMinMergeDelta, base.size() / kBaseToDelta))
+            startMerge();
+    }
+
+    //---------------------------------------------------
+
+    std::vector<ValueType> base;
+    Set<ValueType> frozenAdded, frozenRemoved;  // delta being merged into the base
+    Set<ValueType> added;    // keys absent from the base and the frozen delta
+    Set<ValueType> removed;  // tombstones of keys present there
+    std::future<std::vector<ValueType>> pending;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType>
+template<typename iteratorType>
+BufferedSet<ValueType>::BufferedSet(iteratorType first, iteratorType last) : base(first, last) {
+    std::sort(base.begin(), base.end());
+    base.erase(std::unique(base.begin(), base.end(), [](const ValueType& a, const ValueType& b) {
+        return !(a < b) && !(b < a);
+    }), base.end());
+}
+
+template<typename ValueType>
+BufferedSet<ValueType>::BufferedSet(std::initializer_list<ValueType> init) : BufferedSet(init.begin(), init.end()) {}
+
+template<typename ValueType>
+BufferedSet<ValueType>::~BufferedSet() {
+    if (pending.valid())
+        pending.wait();
+}
+
+template<typename ValueType>
+size_t BufferedSet<ValueType>::size() const {
+    return base.size() - frozenRemoved.size() + frozenAdded.size() - removed.size() + added.size();
+}
+
+template<typename ValueType>
+bool BufferedSet<ValueType>::empty() const {
+    return size() == 0;
+}
+
+template<typename ValueType>
+void BufferedSet<ValueType>::clear() {
+    finishMerge(true);
+    base.clear();
+    added.clear();
+    removed.clear();
+}
+
+template<typename ValueType>
+void BufferedSet<ValueType>::insert(const ValueType& value) {
+    if (removed.find(value) != removed.end())
+        removed.erase(value);
+    else if (!inFrozen(value))
+        added.insert(value);
+    mergeIfLarge();
+}
+
+template<typename ValueType>
+void BufferedSet<ValueType>::erase(const ValueType& value) {
+    if (added.find(value) != added.end())
+        added.erase(value);
+    else if (inFrozen(value))
+        removed.insert(value);
+    mergeIfLarge();
+}
+
+template<typename ValueType>
+void BufferedSet<ValueType>::merge() {
+    finishMerge(true);
+    if (!added.empty() || !removed.empty()) {
+        startMerge();
+        finishMerge(true);
+    }
+}
+
+template<typename ValueType>
+bool BufferedSet<ValueType>::merging() const {
+    return pending.valid();
+}
+
+template<typename ValueType>
+size_t BufferedSet<ValueType>::delta_size() const {
+    return frozenAdded.size() + frozenRemoved.size() + added.size() + removed.size();
+}
+
+template<typename ValueType>
+template<typename Lower>
+BufferedSet<ValueType>::Overlay<Lower>::Overlay(Lower lower, SetIterator added, SetIterator addedEnd,
+                                                SetIterator removed, SetIterator removedEnd)
+    : lower(lower), added(added), addedEnd(addedEnd), removed(removed), removedEnd(removedEnd) {
+    skipRemoved();
+}
+
+template<typename ValueType>
+template<typename Lower>
+bool BufferedSet<ValueType>::Overlay<Lower>::lowerFirst() const {
+    if (lower.done())
+        return false;
+    return added == addedEnd || lower.get() < *added;
+}
+
+// Tombstones are sorted too, so they are matched against the lower layer in lockstep
+template<typename ValueType>
+template<typename Lower>
+void BufferedSet<ValueType>::Overlay<Lower>::skipRemoved() {
+    while (!lower.done() && removed != removedEnd) {
+        if (*removed < lower.get()) {
+            ++removed;
+        } else if (lower.get() < *removed) {
+            break;
+        } else {
+            lower.next();
+            ++removed;
+        }
+    }
+}
+
+template<typename ValueType>
+template<typename Lower>
+bool BufferedSet<ValueType>::Overlay<Lower>::done() const {
+    return lower.done() && added == addedEnd;
+}
+
+template<typename ValueType>
+template<typename Lower>
+const ValueType& BufferedSet<ValueType>::Overlay<Lower>::get() const {
+    return lowerFirst() ? lower.get() : *added;
+}
+
+template<typename ValueType>
+template<typename Lower>
+void BufferedSet<ValueType>::Overlay<Lower>::next() {
+    if (lowerFirst()) {
+        lower.next();
+        skipRemoved();
+    } else {
+        ++added;
+    }
+}
+
+template<typename ValueType>
+template<typename Lower>
+bool BufferedSet<ValueType>::Overlay<Lower>::operator==(const Overlay& other) const {
+    return this->lower == other.lower && this->added == other.added;
+}
+
+template<typename ValueType>
+typename BufferedSet<ValueType>::iterator& BufferedSet<ValueType>::iterator::operator++() {
+    cursor.next();
+    return *this;
+}
+
+template<typename ValueType>
+typename BufferedSet<ValueType>::iterator BufferedSet<ValueType>::iterator::operator++(int) {
+    iterator old(*this);
+    ++*this;
+    return old;
+}
+
+template<typename ValueType>
+const ValueType& BufferedSet<ValueType>::iterator::operator*() const {
+    return cursor.get();
+}
+
+template<typename ValueType>
+const ValueType* BufferedSet<ValueType>::iterator::operator->() const {
+    return &**this;
+}
+
+template<typename ValueType>
+bool BufferedSet<ValueType>::iterator::operator==(const iterator& other) const {
+    return this->cursor == other.cursor;
+}
+
+template<typename ValueType>
+bool BufferedSet<ValueType>::iterator::operator!=(const iterator& other) const {
+    return !(*this == other);
+}
+
+template<typename ValueType>
+typename BufferedSet<ValueType>::iterator BufferedSet<ValueType>::begin() const {
+    return iterator(Cursor(frozenBegin(), added.begin(), added.end(), removed.begin(), removed.end()));
+}
+
+template<typename ValueType>
+typename BufferedSet<ValueType>::iterator BufferedSet<ValueType>::end() const {
+    return iterator(Cursor(frozenAt(nullptr), added.end(), added.end(), removed.end(), removed.end()));
+}
+
+template<typename ValueType>
+typename BufferedSet<ValueType>::iterator BufferedSet<ValueType>::find(const ValueType& key) const {
+    iterator it = lower_bound(key);
+    return it != end() && !(key < *it) ? it : end();
+}
+
+template<typename ValueType>
+typename BufferedSet<ValueType>::iterator BufferedSet<ValueType>::lower_bound(const ValueType& key) const {
+    return iterator(Cursor(frozenAt(&key), added.lower_bound(key), added.end(), removed.lower_bound(key), removed.end()));
+}
+
+template<typename ValueType>
+bool BufferedSet<ValueType>::contains(const ValueType& key) const {
+    if (added.find(key) != added.end())
+        return true;
+    return inFrozen(key) && removed.find(key) == removed.end();
+}
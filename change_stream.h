@@ -0,0 +1,163 @@
+/*-------------------------------------------------------
+
+    Change stream of a Set
+    A SetObserver that copies every change into a lock-free
+    single producer / single consumer ring, so another thread
+    can mirror the set without touching it. The producer is
+    whoever writes the observed set, it waits while the ring
+    is full, so a slow consumer slows writers down instead of
+    losing changes
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+enum class ChangeOp : uint8_t {
+    kInsert,
+    kErase,
+    kClear,  // the key is default constructed
+};
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+template <typename ValueType>
+class ChangeStream : public SetObserver<ValueType> {
+public:
+    struct Change {
+        ChangeOp op = ChangeOp::kClear;
+        ValueType key{};
+    };
+
+    //---------------------------------------------------
+    // constructors
+
+    // capacity is rounded up to a power of two
+    explicit ChangeStream(size_t capacity = 4096);
+
+    ChangeStream(const ChangeStream&) = delete;
+    ChangeStream& operator=(const ChangeStream&) = delete;
+
+    //---------------------------------------------------
+    // Producer side, called by the observed set
+
+    void inserted(const ValueType& key) override;
+
+    void erased(const ValueType& key) override;
+
+    void cleared() override;
+
+    //---------------------------------------------------
+    // Consumer side, one thread at a time
+
+    // Returns false when the ring is empty
+    bool pop(Change& change);
+
+    // Pops up to limit changes into fn(const Change&), returns how many
+    template<typename Function>
+    size_t drain(Function fn, size_t limit = SIZE_MAX);
+
+    // Changes waiting, exact only when both sides are idle
+    size_t size() const;
+
+    size_t capacity() const;
+
+private:
+    void push(ChangeOp op, const ValueType& key) {
+        size_t tail = this->tail.load(std::memory_order_relaxed);
+        while (tail - headCache == capacity()) {
+            headCache = head.load(std::memory_order_acquire);
+            if (tail - headCache == capacity())
+                std::this_thread::yield();
+        }
+
+        Change& slot = ring[tail & mask];
+        slot.op = op;
+        slot.key = key;
+        this->tail.store(tail + 1, std::memory_order_release);
+    }
+
+    //---------------------------------------------------
+
+    size_t mask;
+    std::unique_ptr<Change[]> ring;
+
+    // Each side writes its own index and keeps a stale copy of the
+    // other one, refreshed only when the ring looks full or empty
+    alignas(kCacheLineSize) std::atomic<size_t> tail{0};
+    size_t headCache = 0;
+    alignas(kCacheLineSize) std::atomic<size_t> head{0};
+    size_t tailCache = 0;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType>
+ChangeStream<ValueType>::ChangeStream(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity)
+        size *= 2;
+    mask = size - 1;
+    ring.reset(new Change[size]);
+}
+
+template<typename ValueType>
+void ChangeStream<ValueType>::inserted(const ValueType& key) {
+    push(ChangeOp::kInsert, key);
+}
+
+template<typename ValueType>
+void ChangeStream<ValueType>::erased(const ValueType& key) {
+    push(ChangeOp::kErase, key);
+}
+
+template<typename ValueType>
+void ChangeStream<ValueType>::cleared() {
+    push(ChangeOp::kClear, ValueType{});
+}
+
+template<typename ValueType>
+bool ChangeStream<ValueType>::pop(Change& change) {
+    size_t head = this->head.load(std::memory_order_relaxed);
+    if (head == tailCache) {
+        tailCache = tail.load(std::memory_order_acquire);
+        if (head == tailCache)
+            return false;
+    }
+
+    change = std::move(ring[head & mask]);
+    this->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename ValueType>
+template<typename Function>
+size_t ChangeStream<ValueType>::drain(Function fn, size_t limit) {
+    size_t count = 0;
+    Change change;
+    while (count < limit && pop(change)) {
+        fn(static_cast<const Change&>(change));
+        ++count;
+    }
+    return count;
+}
+
+template<typename ValueType>
+size_t ChangeStream<ValueType>::size() const {
+    size_t head = this->head.load(std::memory_order_acquire);
+    return tail.load(std::memory_order_acquire) - head;
+}
+
+template<typename ValueType>
+size_t ChangeStream<ValueType>::capacity() const {
+    return mask + 1;
+}
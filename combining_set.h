@@ -0,0 +1,166 @@
+/*-------------------------------------------------------
+
+    Set with a flat-combining write path
+    Writers publish their request in a slot instead of queuing
+    on the lock. Whoever gets the lock becomes the combiner and
+    applies every published request as one sorted batch, the
+    others just wait for their slot to be marked done
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+// NodeAlignment is passed on to the Set, kCacheLineSize keeps a combined
+// batch from invalidating lines of nodes it did not touch
+template <typename ValueType, size_t NodeAlignment = 0>
+class CombiningSet {
+public:
+    //---------------------------------------------------
+    // constructors
+
+    // Up to slots writers publish at once, more of them probe for a free slot
+    explicit CombiningSet(size_t slots = 64);
+
+    CombiningSet(const CombiningSet&) = delete;
+    CombiningSet& operator=(const CombiningSet&) = delete;
+
+    //---------------------------------------------------
+    // Methods
+
+    // Return once the request has been applied
+    void insert(const ValueType& value);
+
+    void erase(const ValueType& value);
+
+    // Reads take the lock directly
+    size_t size() const;
+
+    bool contains(const ValueType& key) const;
+
+    // Runs fn(const Set<ValueType, NodeAlignment>&) under the lock
+    template<typename Function>
+    void read(Function fn) const;
+
+private:
+    enum State : int {
+        kFree,
+        kWriting,  // claimed, the request is being filled in
+        kPending,  // published, waiting for a combiner
+        kDone,
+    };
+
+    // Slots sit on separate cache lines, a writer spinning on its own
+    // slot state does not slow down the ones next to it
+    struct alignas(kCacheLineSize) Slot {
+        std::atomic<int> state{kFree};
+        bool insert = false;
+        ValueType key{};
+    };
+
+    // Every thread starts probing from its own slot
+    size_t homeSlot() const {
+        static std::atomic<size_t> threads{0};
+        thread_local size_t id = threads.fetch_add(1);
+        return id % slotCount;
+    }
+
+    void publish(const ValueType& key, bool insert) {
+        Slot* slot = nullptr;
+        for (size_t i = homeSlot(), probes = 1;; i = (i + 1) % slotCount, ++probes) {
+            int expected = kFree;
+            if (slots[i].state.compare_exchange_weak(expected, kWriting, std::memory_order_acquire)) {
+                slot = &slots[i];
+                break;
+            }
+            if (probes % slotCount == 0)
+                std::this_thread::yield();
+        }
+
+        slot->insert = insert;
+        slot->key = key;
+        slot->state.store(kPending, std::memory_order_release);
+
+        while (slot->state.load(std::memory_order_acquire) != kDone) {
+            std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+            if (lock.owns_lock())
+                combine();
+            else
+                std::this_thread::yield();
+        }
+        slot->state.store(kFree, std::memory_order_release);
+    }
+
+    // The caller holds the lock
+    void combine() {
+        std::vector<Slot*> taken;
+        auto tx = set.transaction();
+        for (size_t i = 0; i < slotCount; ++i) {
+            Slot& slot = slots[i];
+            if (slot.state.load(std::memory_order_acquire) != kPending)
+                continue;
+            if (slot.insert)
+                tx.insert(slot.key);
+            else
+                tx.erase(slot.key);
+            taken.push_back(&slot);
+        }
+        tx.commit();
+
+        for (Slot* slot : taken)
+            slot->state.store(kDone, std::memory_order_release);
+    }
+
+    //---------------------------------------------------
+
+    size_t slotCount;
+    std::unique_ptr<Slot[]> slots;
+    alignas(kCacheLineSize) mutable std::mutex mutex;
+    Set<ValueType, NodeAlignment> set;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType, size_t NodeAlignment>
+CombiningSet<ValueType, NodeAlignment>::CombiningSet(size_t slots) : slotCount(std::max<size_t>(slots, 1)), slots(new Slot[slotCount]) {}
+
+template<typename ValueType, size_t NodeAlignment>
+void CombiningSet<ValueType, NodeAlignment>::insert(const ValueType& value) {
+    publish(value, true);
+}
+
+template<typename ValueType, size_t NodeAlignment>
+void CombiningSet<ValueType, NodeAlignment>::erase(const ValueType& value) {
+    publish(value, false);
+}
+
+template<typename ValueType, size_t NodeAlignment>
+size_t CombiningSet<ValueType, NodeAlignment>::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return set.size();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+bool CombiningSet<ValueType, NodeAlignment>::contains(const ValueType& key) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return set.find(key) != set.end();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+template<typename Function>
+void CombiningSet<ValueType, NodeAlignment>::read(Function fn) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    fn(set);
+}
@@ -0,0 +1,267 @@
+/*-------------------------------------------------------
+
+    Read-only sorted set of strings with front coding
+    Keys are grouped in blocks of kBlockKeys, the first key
+    of a block is stored whole and serves as the sampled
+    index, the others only as (shared prefix, suffix)
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+class FrozenStringSet {
+public:
+    //---------------------------------------------------
+    // constructors
+
+    FrozenStringSet() = default;
+    // The range must be sorted and free of duplicates, e.g. a Set<std::string>
+    template<typename iteratorType>
+    FrozenStringSet(iteratorType first, iteratorType last);
+    template<typename SetType>
+    explicit FrozenStringSet(const SetType& set);
+
+    //---------------------------------------------------
+    // Methods
+
+    size_t size() const;
+
+    bool empty() const;
+
+    // Size of the encoded keys and the block index
+    size_t bytes() const;
+
+    //---------------------------------------------------
+    // iterators
+
+    // Forward only, every step decodes one entry
+    class iterator {
+    public:
+        iterator() = default;
+        iterator(const FrozenStringSet* parent, size_t index);
+
+        iterator& operator++();      // ++it
+        iterator operator++(int);    // it++
+
+        const std::string& operator*() const;
+        const std::string* operator->() const;
+
+        bool operator==(const iterator& other) const;
+        bool operator!=(const iterator& other) const;
+
+    private:
+        void decode();
+
+        const FrozenStringSet* parent = nullptr;
+        size_t index = 0;
+        size_t offset = 0;  // of the entry after the current one
+        std::string key;
+    };
+
+    iterator begin() const;
+
+    iterator end() const;
+
+    //---------------------------------------------------
+    // Search methods
+
+    iterator find(std::string_view key) const;
+
+    iterator lower_bound(std::string_view key) const;
+
+    // Keys starting with prefix
+    std::pair<iterator, iterator> prefix_range(std::string_view prefix) const;
+
+private:
+    static constexpr size_t kBlockKeys = 16;
+
+    //---------------------------------------------------
+    // Encoding
+
+    static void putVarint(std::vector<char>& out, size_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    size_t getVarint(size_t& offset) const {
+        size_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            unsigned char byte = data[offset++];
+            value |= size_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+    }
+
+    void append(std::string_view key) {
+        if (count % kBlockKeys == 0) {
+            blocks.push_back(data.size());
+            putVarint(data, key.size());
+            data.insert(data.end(), key.begin(), key.end());
+        } else {
+            size_t shared = 0;
+            size_t limit = std::min(key.size(), previous.size());
+            while (shared < limit && key[shared] == previous[shared])
+                ++shared;
+            putVarint(data, shared);
+            putVarint(data, key.size() - shared);
+            data.insert(data.end(), key.begin() + shared, key.end());
+        }
+        previous.assign(key.data(), key.size());
+        ++count;
+    }
+
+    std::string_view blockHead(size_t block) const {
+        size_t offset = blocks[block];
+        size_t length = getVarint(offset);
+        return std::string_view(data.data() + offset, length);
+    }
+
+    // Last block whose head is <= key, or the first one
+    size_t findBlock(std::string_view key) const {
+        size_t lo = 0, hi = blocks.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (key < blockHead(mid))
+                hi = mid;
+            else
+                lo = mid;
+        }
+        return lo;
+    }
+
+    //---------------------------------------------------
+
+    std::vector<char> data;
+    std::vector<size_t> blocks;  // offset of every block head
+    size_t count = 0;
+    std::string previous;        // only used while building
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename iteratorType>
+FrozenStringSet::FrozenStringSet(iteratorType first, iteratorType last) {
+    for (; first != last; ++first)
+        append(*first);
+    previous.clear();
+    previous.shrink_to_fit();
+    data.shrink_to_fit();
+    blocks.shrink_to_fit();
+}
+
+template<typename SetType>
+FrozenStringSet::FrozenStringSet(const SetType& set) : FrozenStringSet(set.begin(), set.end()) {}
+
+inline size_t FrozenStringSet::size() const {
+    return count;
+}
+
+inline bool FrozenStringSet::empty() const {
+    return count == 0;
+}
+
+inline size_t FrozenStringSet::bytes() const {
+    return data.size() + blocks.size() * sizeof(size_t);
+}
+
+inline FrozenStringSet::iterator::iterator(const FrozenStringSet* parent, size_t index) : parent(parent), index(index) {
+    if (index >= parent->count)
+        return;
+
+    // Entries only make sense relative to their block head
+    this->index -= index % kBlockKeys;
+    decode();
+    while (this->index < index)
+        ++*this;
+}
+
+inline void FrozenStringSet::iterator::decode() {
+    size_t shared = 0;
+    if (index % kBlockKeys == 0)
+        offset = parent->blocks[index / kBlockKeys];
+    else
+        shared = parent->getVarint(offset);
+    size_t length = parent->getVarint(offset);
+    key.resize(shared);
+    key.append(parent->data.data() + offset, length);
+    offset += length;
+}
+
+inline FrozenStringSet::iterator& FrozenStringSet::iterator::operator++() {
+    if (++index < parent->count)
+        decode();
+    return *this;
+}
+
+inline FrozenStringSet::iterator FrozenStringSet::iterator::operator++(int) {
+    iterator old(*this);
+    ++*this;
+    return old;
+}
+
+inline const std::string& FrozenStringSet::iterator::operator*() const {
+    return key;
+}
+
+inline const std::string* FrozenStringSet::iterator::operator->() const {
+    return &key;
+}
+
+inline bool FrozenStringSet::iterator::operator==(const iterator& other) const {
+    return this->index == other.index && this->parent == other.parent;
+}
+
+inline bool FrozenStringSet::iterator::operator!=(const iterator& other) const {
+    return this->index != other.index || this->parent != other.parent;
+}
+
+inline FrozenStringSet::iterator FrozenStringSet::begin() const {
+    return iterator(this, 0);
+}
+
+inline FrozenStringSet::iterator FrozenStringSet::end() const {
+    return iterator(this, count);
+}
+
+inline FrozenStringSet::iterator FrozenStringSet::find(std::string_view key) const {
+    iterator it = lower_bound(key);
+    return it != end() && *it == key ? it : end();
+}
+
+inline FrozenStringSet::iterator FrozenStringSet::lower_bound(std::string_view key) const {
+    if (empty())
+        return end();
+
+    iterator it(this, findBlock(key) * kBlockKeys);
+    for (size_t i = 0; i < kBlockKeys && it != end() && *it < key; ++i)
+        ++it;
+    return it;
+}
+
+inline std::pair<FrozenStringSet::iterator, FrozenStringSet::iterator>
+FrozenStringSet::prefix_range(std::string_view prefix) const {
+    std::string upper(prefix);
+    if (!prefixSuccessor(upper))
+        return {lower_bound(prefix), end()};
+    return {lower_bound(prefix), lower_bound(upper)};
+}
@@ -0,0 +1,240 @@
+/*-------------------------------------------------------
+
+    Set with per-core write buffers for scalable ingest
+    Writers append to the unsorted buffer of the core they start
+    on, so they only contend with threads of the same core.
+    A full buffer is merged into the shared Set as one batch,
+    and a background tick merges any buffer whose oldest
+    operation has waited maxDelay, so on a quiet core writes
+    still reach default readers within about maxDelay
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+// NodeAlignment is passed on to the shared Set, kCacheLineSize keeps a
+// merge from invalidating lines of nodes it did not touch
+template <typename ValueType, size_t NodeAlignment = 0>
+class IngestSet {
+public:
+    //---------------------------------------------------
+    // constructors
+
+    // buffers == 0 means one per hardware thread, a buffer is merged
+    // once it holds flushSize operations or its oldest one is maxDelay
+    // old; maxDelay == 0 leaves out the tick and its thread
+    explicit IngestSet(size_t buffers = 0, size_t flushSize = 4096,
+                       std::chrono::milliseconds maxDelay = std::chrono::milliseconds(10));
+
+    IngestSet(const IngestSet&) = delete;
+    IngestSet& operator=(const IngestSet&) = delete;
+
+    // Stops the tick, operations still buffered are dropped
+    ~IngestSet();
+
+    //---------------------------------------------------
+    // Methods
+
+    void insert(const ValueType& value);
+
+    void erase(const ValueType& value);
+
+    // Merges every buffer into the shared set
+    void flush();
+
+    // Size of the shared set, pending operations are not counted
+    size_t size() const;
+
+    // Without consultPending operations buffered for less than about
+    // maxDelay may be missed. With it the latest buffered operation on
+    // key wins; operations on one key buffered on different cores have
+    // no defined order until they are merged
+    bool contains(const ValueType& key, bool consultPending = false) const;
+
+    // Operations waiting in the buffers
+    size_t pending() const;
+
+    // Runs fn(const Set<ValueType, NodeAlignment>&) under the shared set's read lock
+    template<typename Function>
+    void read(Function fn) const;
+
+private:
+    // One buffer per cache line, so cores do not fight over each other's locks
+    struct alignas(kCacheLineSize) Buffer {
+        mutable std::mutex mutex;
+        std::vector<std::pair<ValueType, bool>> changes;  // (key, insert?)
+        std::chrono::steady_clock::time_point since;     // of the oldest change
+    };
+
+    // Picked by the core a thread first writes from and kept afterwards,
+    // so all operations of one thread stay in one buffer and in order
+    Buffer& localBuffer() {
+        thread_local size_t home = [] {
+#ifdef __linux__
+            int cpu = sched_getcpu();
+            if (cpu >= 0)
+                return size_t(cpu);
+#endif
+            return std::hash<std::thread::id>()(std::this_thread::get_id());
+        }();
+        return buffers[home % bufferCount];
+    }
+
+    void append(const ValueType& key, bool insert) {
+        Buffer& buffer = localBuffer();
+        std::lock_guard<std::mutex> lock(buffer.mutex);
+        if (buffer.changes.empty())
+            buffer.since = std::chrono::steady_clock::now();
+        buffer.changes.emplace_back(key, insert);
+        if (buffer.changes.size() >= flushSize)
+            merge(buffer);
+    }
+
+    // The caller holds the buffer lock, so merges of one buffer keep their order
+    void merge(Buffer& buffer) {
+        std::vector<std::pair<ValueType, bool>> changes;
+        changes.swap(buffer.changes);
+        if (changes.empty())
+            return;
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto tx = set.transaction();
+        for (const auto& change : changes) {
+            if (change.second)
+                tx.insert(change.first);
+            else
+                tx.erase(change.first);
+        }
+        tx.commit();
+    }
+
+    // Wakes every maxDelay / 2 and merges buffers at least that old, so
+    // no operation waits much longer than maxDelay
+    void tick() {
+        auto period = std::max<std::chrono::steady_clock::duration>(maxDelay / 2, std::chrono::milliseconds(1));
+        std::unique_lock<std::mutex> lock(tickMutex);
+        while (!tickWake.wait_for(lock, period, [this] { return stopping; })) {
+            auto now = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < bufferCount; ++i) {
+                std::lock_guard<std::mutex> guard(buffers[i].mutex);
+                if (!buffers[i].changes.empty() && now - buffers[i].since >= period)
+                    merge(buffers[i]);
+            }
+        }
+    }
+
+    //---------------------------------------------------
+
+    size_t bufferCount;
+    size_t flushSize;
+    std::chrono::milliseconds maxDelay;
+    std::unique_ptr<Buffer[]> buffers;
+    alignas(kCacheLineSize) mutable std::shared_mutex mutex;
+    Set<ValueType, NodeAlignment> set;
+
+    std::mutex tickMutex;
+    std::condition_variable tickWake;
+    bool stopping = false;
+    std::thread ticker;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType, size_t NodeAlignment>
+IngestSet<ValueType, NodeAlignment>::IngestSet(size_t buffers, size_t flushSize, std::chrono::milliseconds maxDelay)
+    : bufferCount(buffers ? buffers : std::max(1u, std::thread::hardware_concurrency())),
+      flushSize(std::max<size_t>(flushSize, 1)),
+      maxDelay(maxDelay),
+      buffers(new Buffer[bufferCount]) {
+    if (maxDelay.count() > 0)
+        ticker = std::thread(&IngestSet::tick, this);
+}
+
+template<typename ValueType, size_t NodeAlignment>
+IngestSet<ValueType, NodeAlignment>::~IngestSet() {
+    {
+        std::lock_guard<std::mutex> lock(tickMutex);
+        stopping = true;
+    }
+    tickWake.notify_all();
+    if (ticker.joinable())
+        ticker.join();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+void IngestSet<ValueType, NodeAlignment>::insert(const ValueType& value) {
+    append(value, true);
+}
+
+template<typename ValueType, size_t NodeAlignment>
+void IngestSet<ValueType, NodeAlignment>::erase(const ValueType& value) {
+    append(value, false);
+}
+
+template<typename ValueType, size_t NodeAlignment>
+void IngestSet<ValueType, NodeAlignment>::flush() {
+    for (size_t i = 0; i < bufferCount; ++i) {
+        std::lock_guard<std::mutex> lock(buffers[i].mutex);
+        merge(buffers[i]);
+    }
+}
+
+template<typename ValueType, size_t NodeAlignment>
+size_t IngestSet<ValueType, NodeAlignment>::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return set.size();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+bool IngestSet<ValueType, NodeAlignment>::contains(const ValueType& key, bool consultPending) const {
+    if (consultPending) {
+        for (size_t i = 0; i < bufferCount; ++i) {
+            std::lock_guard<std::mutex> lock(buffers[i].mutex);
+            const auto& changes = buffers[i].changes;
+            for (auto it = changes.rbegin(); it != changes.rend(); ++it)
+                if (!(it->first < key) && !(key < it->first))
+                    return it->second;
+        }
+    }
+
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return set.find(key) != set.end();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+size_t IngestSet<ValueType, NodeAlignment>::pending() const {
+    size_t result = 0;
+    for (size_t i = 0; i < bufferCount; ++i) {
+        std::lock_guard<std::mutex> lock(buffers[i].mutex);
+        result += buffers[i].changes.size();
+    }
+    return result;
+}
+
+template<typename ValueType, size_t NodeAlignment>
+template<typename Function>
+void IngestSet<ValueType, NodeAlignment>::read(Function fn) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    fn(set);
+}
@@ -0,0 +1,381 @@
+/*-------------------------------------------------------
+
+    AVL tree stored in a single relocatable memory region
+    Set with OffsetLinks: nodes refer to each other by their
+    distance from the link instead of pointers, so the region
+    may be memcpy'd, written to disk, mmap'd or shared at any
+    address and used as is. Keys must be trivially copyable
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+/*-------------------------------------------------------
+    Offset links
+    OffsetPtr<Node> holds the distance from itself to its
+    target, 0 is null. Copies are taken through the target,
+    so a copy anywhere still points at the same node, while
+    moving the whole region keeps every distance.
+-------------------------------------------------------*/
+
+template <typename Node>
+class OffsetPtr {
+public:
+    OffsetPtr() = default;
+
+    OffsetPtr(Node* target) {
+        *this = target;
+    }
+
+    OffsetPtr(const OffsetPtr& other) : OffsetPtr(other.get()) {}
+
+    OffsetPtr& operator=(Node* target) {
+        offset = target ? int64_t(uintptr_t(target) - uintptr_t(this)) : 0;
+        return *this;
+    }
+
+    OffsetPtr& operator=(const OffsetPtr& other) {
+        return *this = other.get();
+    }
+
+    Node* get() const {
+        return offset ? reinterpret_cast<Node*>(uintptr_t(this) + offset) : nullptr;
+    }
+
+    operator Node*() const {
+        return get();
+    }
+
+    Node* operator->() const {
+        return get();
+    }
+
+    // get() in one load, for readers racing a writer
+    Node* load() const {
+        int64_t at = __atomic_load_n(&offset, __ATOMIC_RELAXED);
+        return at ? reinterpret_cast<Node*>(uintptr_t(this) + at) : nullptr;
+    }
+
+private:
+    int64_t offset = 0;
+};
+
+// Nodes of a region formatted by OffsetTree, handed out from its node
+// array and recycled through a free list chained by Node::left
+template <typename Node>
+class RegionStorage {
+public:
+    // Lives at the very start of the region
+    struct Header {
+        uint64_t magic;
+        uint64_t keySize;
+        uint64_t capacity;
+        uint64_t nodes;  // offset of the node array from the region start
+        OffsetPtr<Node> root;
+        OffsetPtr<Node> freeList;
+        uint64_t used;   // nodes handed out from the array
+    };
+
+    RegionStorage() = default;
+    RegionStorage(const RegionStorage&) = delete;
+    RegionStorage& operator=(const RegionStorage&) = delete;
+
+    OffsetPtr<Node>& root() {
+        return header()->root;
+    }
+
+    const OffsetPtr<Node>& root() const {
+        return header()->root;
+    }
+
+    // Throws std::length_error when there is no free node
+    template<typename... Args>
+    Node* create(Args&&... args) {
+        Header* h = header();
+        Node* t = h->freeList;
+        if (t) {
+            h->freeList = t->left;
+        } else {
+            if (h->used == h->capacity)
+                throw std::length_error("OffsetTree: region is full");
+            t = reinterpret_cast<Node*>(base + h->nodes) + h->used++;
+        }
+        return new (t) Node(std::forward<Args>(args)...);
+    }
+
+    void destroy(Node* t) {
+        t->left = header()->freeList;
+        header()->freeList = t;
+    }
+
+    // Empties the tree, a detached storage has nothing to release
+    void release() {
+        if (!base)
+            return;
+        header()->root = header()->freeList = nullptr;
+        header()->used = 0;
+    }
+
+    void swap(RegionStorage& other) noexcept {
+        std::swap(base, other.base);
+    }
+
+    void rebase(char* base) {
+        this->base = base;
+    }
+
+    char* data() const {
+        return base;
+    }
+
+    Header* header() const {
+        return reinterpret_cast<Header*>(base);
+    }
+
+private:
+    char* base = nullptr;
+};
+
+// Regions keep their nodes at the natural alignment
+struct OffsetLinks {
+    template <typename Node>
+    using Link = OffsetPtr<Node>;
+
+    template <typename Node, size_t NodeAlignment>
+    using Storage = RegionStorage<Node>;
+};
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+// A view of a region, copies share it and destroying one leaves it as is
+template <typename ValueType>
+class OffsetTree {
+    static_assert(std::is_trivially_copyable<ValueType>::value, "regions hold raw keys");
+
+    using Tree = Set<ValueType, 0, OffsetLinks>;
+
+public:
+    using Node = typename Tree::TreeNode;
+    using Header = typename RegionStorage<Node>::Header;
+
+    static constexpr uint64_t kMagic = 0x32455254564c4156;  // "VAVLTRE2"
+
+    // Bytes needed for capacity nodes placed after reserved header bytes
+    static size_t regionSize(size_t reserved, size_t capacity) {
+        return nodesOffset(reserved) + capacity * sizeof(Node);
+    }
+
+    OffsetTree() = default;
+    explicit OffsetTree(char* base);
+    OffsetTree(const OffsetTree& other);
+    OffsetTree& operator=(const OffsetTree& other);
+
+    ~OffsetTree();
+
+    // Writes an empty tree into base, reserved bytes after the header stay for the owner
+    static void format(char* base, size_t reserved, size_t capacity);
+
+    // True if base holds a tree of this key type fitting in length bytes
+    static bool valid(const char* base, size_t length);
+
+    // The region moved, offsets need no fix-up
+    void rebase(char* base);
+
+    // The region was extended to hold capacity nodes
+    void grow(size_t capacity);
+
+    char* data() const;
+
+    Header* header() const;
+
+    size_t size() const;
+
+    bool full() const;
+
+    // Throws std::length_error when there is no free node
+    void insert(const ValueType& key);
+
+    void erase(const ValueType& key);
+
+    void clear();
+
+    // Smallest key >= key (or > key when strict), nullptr if there is none
+    const ValueType* lowerBound(const ValueType& key, bool strict) const;
+
+    const ValueType* min() const;
+
+    //---------------------------------------------------
+    // For readers racing a writer that check afterwards whether one
+    // came by, see SharedSet. Every link is checked to land on a node
+    // of the array and walks stop at any AVL tree's height, so a torn
+    // tree sets torn rather than crashing. Keys are copied out, their
+    // node may be reused right after
+
+    size_t racySize(bool& torn) const;
+
+    // Like lowerBound(), nullptr key finds the smallest key; returns
+    // false if there is no such key
+    bool racyLowerBound(const ValueType* key, bool strict, ValueType& result, bool& torn) const;
+
+private:
+    static constexpr size_t kMaxHeight = 128;  // AVL trees of 2^64 nodes are lower
+
+    static size_t nodesOffset(size_t reserved) {
+        return (sizeof(Header) + reserved + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+    }
+
+    bool inArray(const Node* t) const {
+        uintptr_t first = uintptr_t(data() + header()->nodes), at = uintptr_t(t);
+        return at >= first && (at - first) % sizeof(Node) == 0 && (at - first) / sizeof(Node) < header()->capacity;
+    }
+
+    //---------------------------------------------------
+
+    Tree set;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType>
+OffsetTree<ValueType>::OffsetTree(char* base) {
+    rebase(base);
+}
+
+template<typename ValueType>
+OffsetTree<ValueType>::OffsetTree(const OffsetTree& other) : OffsetTree(other.data()) {}
+
+template<typename ValueType>
+OffsetTree<ValueType>& OffsetTree<ValueType>::operator=(const OffsetTree& other) {
+    rebase(other.data());
+    return *this;
+}
+
+template<typename ValueType>
+OffsetTree<ValueType>::~OffsetTree() {
+    rebase(nullptr);  // so that the set's destructor leaves the region alone
+}
+
+template<typename ValueType>
+void OffsetTree<ValueType>::format(char* base, size_t reserved, size_t capacity) {
+    Header* h = new (base) Header();
+    h->keySize = sizeof(ValueType);
+    h->capacity = capacity;
+    h->nodes = nodesOffset(reserved);
+    h->used = 0;
+    __atomic_store_n(&h->magic, kMagic, __ATOMIC_RELEASE);  // whoever maps it may look now
+}
+
+template<typename ValueType>
+bool OffsetTree<ValueType>::valid(const char* base, size_t length) {
+    if (length < sizeof(Header))
+        return false;
+    const Header* h = reinterpret_cast<const Header*>(base);
+    return __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == kMagic && h->keySize == sizeof(ValueType) &&
+           h->nodes >= sizeof(Header) && h->nodes % alignof(Node) == 0 &&
+           h->nodes + h->capacity * sizeof(Node) <= length;
+}
+
+template<typename ValueType>
+void OffsetTree<ValueType>::rebase(char* base) {
+    set.nodes.rebase(base);
+}
+
+template<typename ValueType>
+void OffsetTree<ValueType>::grow(size_t capacity) {
+    header()->capacity = std::max<size_t>(header()->capacity, capacity);
+}
+
+template<typename ValueType>
+char* OffsetTree<ValueType>::data() const {
+    return set.nodes.data();
+}
+
+template<typename ValueType>
+typename OffsetTree<ValueType>::Header* OffsetTree<ValueType>::header() const {
+    return set.nodes.header();
+}
+
+template<typename ValueType>
+size_t OffsetTree<ValueType>::size() const {
+    return set.size();
+}
+
+template<typename ValueType>
+bool OffsetTree<ValueType>::full() const {
+    return !header()->freeList && header()->used == header()->capacity;
+}
+
+template<typename ValueType>
+void OffsetTree<ValueType>::insert(const ValueType& key) {
+    set.insert(key);
+}
+
+template<typename ValueType>
+void OffsetTree<ValueType>::erase(const ValueType& key) {
+    set.erase(key);
+}
+
+template<typename ValueType>
+void OffsetTree<ValueType>::clear() {
+    set.clear();
+}
+
+template<typename ValueType>
+const ValueType* OffsetTree<ValueType>::lowerBound(const ValueType& key, bool strict) const {
+    typename Tree::iterator it = set.lower_bound(key);
+    if (strict && it != set.end() && !(key < *it))
+        ++it;
+    return it != set.end() ? &*it : nullptr;
+}
+
+template<typename ValueType>
+const ValueType* OffsetTree<ValueType>::min() const {
+    typename Tree::iterator it = set.begin();
+    return it != set.end() ? &*it : nullptr;
+}
+
+template<typename ValueType>
+size_t OffsetTree<ValueType>::racySize(bool& torn) const {
+    const Node* t = header()->root.load();
+    if (!t)
+        return 0;
+    if (!inArray(t)) {
+        torn = true;
+        return 0;
+    }
+    return __atomic_load_n(&t->cnt, __ATOMIC_RELAXED);
+}
+
+template<typename ValueType>
+bool OffsetTree<ValueType>::racyLowerBound(const ValueType* key, bool strict, ValueType& result, bool& torn) const {
+    bool found = false;
+    const Node* t = header()->root.load();
+    for (size_t depth = 0; t; ++depth) {
+        if (depth == kMaxHeight || !inArray(t)) {
+            torn = true;
+            return false;
+        }
+        ValueType current;
+        std::memcpy(&current, &t->key, sizeof(ValueType));
+        if (!key || (strict ? *key < current : !(current < *key))) {
+            result = current;
+            found = true;
+            t = t->left.load();
+        } else {
+            t = t->right.load();
+        }
+    }
+    return found;
+}
@@ -0,0 +1,575 @@
+/*-------------------------------------------------------
+
+    Range-partitioned Set served by several processes
+    PartitionServer forks one process per key range, each one
+    keeps a Set and answers requests on prefix.<i> with a
+    poll loop. PartitionClient splits every batch by range,
+    writes all requests before reading any answer and merges
+    the answers back in key order. Keys must be trivially
+    copyable
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+#include "unix_socket.h"
+
+#include <csignal>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+/*-------------------------------------------------------
+    Wire format
+-------------------------------------------------------*/
+
+enum class PartitionOp : uint8_t {
+    kInsert,
+    kErase,
+    kFind,        // answers one byte per key
+    kLowerBound,  // answers one found byte per key, then the keys
+    kScan,        // one key, answers up to limit keys from its lower bound
+};
+
+struct PartitionRequest {
+    uint32_t count;  // keys following the header
+    uint32_t limit;
+    PartitionOp op;
+    uint8_t padding[7];
+};
+
+struct PartitionResponse {
+    uint32_t count;
+    uint32_t padding;
+};
+
+// Sockets are named prefix.0, prefix.1, ...
+inline std::string partitionPath(const std::string& prefix, size_t partition) {
+    return prefix + "." + std::to_string(partition);
+}
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+template <typename ValueType>
+class PartitionServer {
+public:
+    static_assert(std::is_trivially_copyable<ValueType>::value, "PartitionServer keys are sent as raw bytes");
+
+    //---------------------------------------------------
+    // constructors & destructor
+
+    // Partition i holds [bounds[i - 1], bounds[i]), bounds must be sorted.
+    // Forks, so construct it before the process starts other threads
+    PartitionServer(const std::string& prefix, std::vector<ValueType> bounds);
+
+    PartitionServer(const PartitionServer&) = delete;
+    PartitionServer& operator=(const PartitionServer&) = delete;
+
+    // Stops the partition processes and removes their sockets
+    ~PartitionServer();
+
+    //---------------------------------------------------
+    // Methods
+
+    size_t partitions() const;
+
+private:
+    struct Connection {
+        int fd;
+        std::vector<char> in, out;
+        size_t sent = 0;
+    };
+
+    static constexpr size_t kMaxBufferedOutput = 1 << 20;
+
+    // Runs in the partition process and never returns
+    [[noreturn]] static void serve(int listenFd) {
+        Set<ValueType> set;
+        std::vector<Connection> connections;
+        std::vector<pollfd> fds;
+        char chunk[1 << 16];
+
+        while (true) {
+            fds.assign(1, pollfd{listenFd, POLLIN, 0});
+            for (const Connection& connection : connections) {
+                // Stop reading from a client that does not read its answers
+                short events = connection.out.size() - connection.sent < kMaxBufferedOutput ? POLLIN : 0;
+                if (connection.sent < connection.out.size())
+                    events |= POLLOUT;
+                fds.push_back(pollfd{connection.fd, events, 0});
+            }
+            if (::poll(fds.data(), fds.size(), -1) < 0)
+                continue;
+
+            for (size_t i = 0; i < connections.size(); ++i) {
+                Connection& connection = connections[i];
+                short revents = fds[i + 1].revents;
+                bool closed = revents & (POLLERR | POLLNVAL);
+
+                if (!closed && (revents & (POLLIN | POLLHUP))) {
+                    ssize_t got = ::recv(connection.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+                    if (got > 0)
+                        connection.in.insert(connection.in.end(), chunk, chunk + got);
+                    else if (got == 0 || (errno != EAGAIN && errno != EINTR))
+                        closed = true;
+                    handle(set, connection);
+                }
+
+                if (!closed && (revents & POLLOUT)) {
+                    ssize_t sent = ::send(connection.fd, connection.out.data() + connection.sent,
+                                          connection.out.size() - connection.sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+                    if (sent > 0)
+                        connection.sent += sent;
+                    else if (sent < 0 && errno != EAGAIN && errno != EINTR)
+                        closed = true;
+                    if (connection.sent == connection.out.size()) {
+                        connection.out.clear();
+                        connection.sent = 0;
+                    }
+                }
+
+                if (closed)
+                    connection.fd = -1;
+            }
+
+            for (size_t i = connections.size(); i--;) {
+                if (connections[i].fd < 0) {
+                    ::close(fds[i + 1].fd);
+                    connections.erase(connections.begin() + i);
+                }
+            }
+
+            if (fds[0].revents & POLLIN) {
+                int fd = ::accept(listenFd, nullptr, nullptr);
+                if (fd >= 0) {
+                    UnixSocket::setNonBlocking(fd);
+                    connections.push_back(Connection{fd, {}, {}, 0});
+                }
+            }
+        }
+    }
+
+    // Answers every complete request in connection.in
+    static void handle(Set<ValueType>& set, Connection& connection) {
+        size_t offset = 0;
+        std::vector<ValueType> keys;
+        while (connection.in.size() - offset >= sizeof(PartitionRequest)) {
+            PartitionRequest request;
+            std::memcpy(&request, connection.in.data() + offset, sizeof(request));
+            size_t bytes = sizeof(request) + size_t(request.count) * sizeof(ValueType);
+            if (connection.in.size() - offset < bytes)
+                break;
+
+            keys.resize(request.count);
+            std::memcpy(keys.data(), connection.in.data() + offset + sizeof(request), request.count * sizeof(ValueType));
+            offset += bytes;
+            answer(set, request, keys, connection.out);
+        }
+        connection.in.erase(connection.in.begin(), connection.in.begin() + offset);
+    }
+
+    static void answer(Set<ValueType>& set, const PartitionRequest& request, const std::vector<ValueType>& keys,
+                       std::vector<char>& out) {
+        size_t start = out.size();
+        out.resize(start + sizeof(PartitionResponse));
+        PartitionResponse response = {};
+
+        auto append = [&out](const void* data, size_t size) {
+            const char* bytes = static_cast<const char*>(data);
+            out.insert(out.end(), bytes, bytes + size);
+        };
+
+        switch (request.op) {
+            case PartitionOp::kInsert:
+            case PartitionOp::kErase: {
+                auto tx = set.transaction();
+                for (const ValueType& key : keys) {
+                    if (request.op == PartitionOp::kInsert)
+                        tx.insert(key);
+                    else
+                        tx.erase(key);
+                }
+                tx.commit();
+                break;
+            }
+            case PartitionOp::kFind:
+                for (const ValueType& key : keys) {
+                    uint8_t found = set.find(key) != set.end();
+                    append(&found, 1);
+                }
+                response.count = keys.size();
+                break;
+            case PartitionOp::kLowerBound: {
+                std::vector<ValueType> bounds(keys.size());
+                for (size_t i = 0; i < keys.size(); ++i) {
+                    auto it = set.lower_bound(keys[i]);
+                    uint8_t found = it != set.end();
+                    if (found)
+                        bounds[i] = *it;
+                    append(&found, 1);
+                }
+                append(bounds.data(), bounds.size() * sizeof(ValueType));
+                response.count = keys.size();
+                break;
+            }
+            case PartitionOp::kScan:
+                if (keys.empty())
+                    break;
+                for (auto it = set.lower_bound(keys[0]); it != set.end() && response.count < request.limit; ++it) {
+                    append(&*it, sizeof(ValueType));
+                    ++response.count;
+                }
+                break;
+        }
+        std::memcpy(out.data() + start, &response, sizeof(response));
+    }
+
+    void stop() {
+        for (pid_t pid : children)
+            ::kill(pid, SIGTERM);
+        for (pid_t pid : children)
+            ::waitpid(pid, nullptr, 0);
+        for (size_t i = 0; i < children.size(); ++i)
+            ::unlink(partitionPath(prefix, i).c_str());
+        children.clear();
+    }
+
+    //---------------------------------------------------
+
+    std::string prefix;
+    std::vector<ValueType> bounds;
+    std::vector<pid_t> children;
+};
+
+template <typename ValueType>
+class PartitionClient {
+public:
+    static_assert(std::is_trivially_copyable<ValueType>::value, "PartitionClient keys are sent as raw bytes");
+
+    //---------------------------------------------------
+    // constructors & destructor
+
+    // bounds must match the server's
+    PartitionClient(const std::string& prefix, std::vector<ValueType> bounds);
+
+    PartitionClient(const PartitionClient&) = delete;
+    PartitionClient& operator=(const PartitionClient&) = delete;
+
+    ~PartitionClient();
+
+    //---------------------------------------------------
+    // Batched methods, one request per partition and one round trip
+
+    void insert(const std::vector<ValueType>& keys);
+
+    void erase(const std::vector<ValueType>& keys);
+
+    // result[i] tells whether keys[i] is present
+    std::vector<bool> contains(const std::vector<ValueType>& keys);
+
+    // result[i].first is false when nothing is >= keys[i]; a miss in a
+    // partition costs one more round trip for the minima of the next ones
+    std::vector<std::pair<bool, ValueType>> lower_bound(const std::vector<ValueType>& keys);
+
+    // Up to limit keys >= from in order. A partition is asked only for what
+    // the ones before it left short, one round trip each
+    std::vector<ValueType> scan(const ValueType& from, size_t limit);
+
+    size_t partitions() const;
+
+private:
+    // Requests written to a partition and where their answers start
+    struct Channel {
+        int fd = -1;
+        std::vector<char> out, in;
+        size_t sent = 0, parsed = 0;
+        std::vector<PartitionOp> ops;
+        std::vector<size_t> answers;
+    };
+
+    size_t partitionOf(const ValueType& key) const {
+        return std::upper_bound(bounds.begin(), bounds.end(), key) - bounds.begin();
+    }
+
+    void request(size_t partition, PartitionOp op, const ValueType* keys, size_t count, uint32_t limit = 0) {
+        Channel& channel = channels[partition];
+        PartitionRequest header = {};
+        header.count = count;
+        header.limit = limit;
+        header.op = op;
+        const char* bytes = reinterpret_cast<const char*>(&header);
+        channel.out.insert(channel.out.end(), bytes, bytes + sizeof(header));
+        bytes = reinterpret_cast<const char*>(keys);
+        channel.out.insert(channel.out.end(), bytes, bytes + count * sizeof(ValueType));
+        channel.ops.push_back(op);
+    }
+
+    static size_t payloadSize(PartitionOp op, uint32_t count) {
+        switch (op) {
+            case PartitionOp::kFind:
+                return count;
+            case PartitionOp::kLowerBound:
+                return count * (1 + sizeof(ValueType));
+            case PartitionOp::kScan:
+                return count * sizeof(ValueType);
+            default:
+                return 0;
+        }
+    }
+
+    // Answer j of a channel: its count and payload
+    std::pair<uint32_t, const char*> answer(const Channel& channel, size_t j) const {
+        PartitionResponse response;
+        std::memcpy(&response, channel.in.data() + channel.answers[j], sizeof(response));
+        return {response.count, channel.in.data() + channel.answers[j] + sizeof(response)};
+    }
+
+    // Writes every queued request and reads all answers, interleaving
+    // both so neither side blocks on a full socket
+    void exchange() {
+        for (Channel& channel : channels) {
+            channel.in.clear();
+            channel.sent = channel.parsed = 0;
+            channel.answers.clear();
+        }
+
+        std::vector<pollfd> fds(channels.size());
+        char chunk[1 << 16];
+        while (true) {
+            bool busy = false;
+            for (size_t i = 0; i < channels.size(); ++i) {
+                const Channel& channel = channels[i];
+                fds[i] = pollfd{channel.fd, 0, 0};
+                if (channel.sent < channel.out.size())
+                    fds[i].events |= POLLOUT;
+                if (channel.answers.size() < channel.ops.size())
+                    fds[i].events |= POLLIN;
+                busy |= fds[i].events != 0;
+            }
+            if (!busy)
+                break;
+            if (::poll(fds.data(), fds.size(), -1) < 0) {
+                UnixSocket::check(errno == EINTR, "poll");
+                continue;
+            }
+
+            for (size_t i = 0; i < channels.size(); ++i) {
+                Channel& channel = channels[i];
+                if (fds[i].revents & (POLLERR | POLLNVAL))
+                    throw std::runtime_error("PartitionClient: partition " + std::to_string(i) + " went away");
+
+                if (fds[i].revents & POLLOUT) {
+                    ssize_t sent = ::send(channel.fd, channel.out.data() + channel.sent,
+                                          channel.out.size() - channel.sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+                    UnixSocket::check(sent >= 0 || errno == EAGAIN || errno == EINTR, "send");
+                    if (sent > 0)
+                        channel.sent += sent;
+                }
+
+                if (fds[i].revents & (POLLIN | POLLHUP)) {
+                    ssize_t got = ::recv(channel.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+                    if (got == 0)
+                        throw std::runtime_error("PartitionClient: partition " + std::to_string(i) + " went away");
+                    UnixSocket::check(got > 0 || errno == EAGAIN || errno == EINTR, "recv");
+                    if (got > 0)
+                        channel.in.insert(channel.in.end(), chunk, chunk + got);
+                }
+
+                while (channel.answers.size() < channel.ops.size() &&
+                       channel.in.size() - channel.parsed >= sizeof(PartitionResponse)) {
+                    PartitionResponse response;
+                    std::memcpy(&response, channel.in.data() + channel.parsed, sizeof(response));
+                    size_t bytes = sizeof(response) + payloadSize(channel.ops[channel.answers.size()], response.count);
+                    if (channel.in.size() - channel.parsed < bytes)
+                        break;
+                    channel.answers.push_back(channel.parsed);
+                    channel.parsed += bytes;
+                }
+            }
+        }
+
+        for (Channel& channel : channels) {
+            channel.out.clear();
+            channel.ops.clear();
+        }
+    }
+
+    // Sends keys to their partitions as one request each, returns
+    // the position of every key inside its partition's request
+    std::vector<size_t> split(PartitionOp op, const std::vector<ValueType>& keys) {
+        std::vector<std::vector<ValueType>> parts(channels.size());
+        std::vector<size_t> positions(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            std::vector<ValueType>& part = parts[partitionOf(keys[i])];
+            positions[i] = part.size();
+            part.push_back(keys[i]);
+        }
+        for (size_t p = 0; p < parts.size(); ++p)
+            if (!parts[p].empty())
+                request(p, op, parts[p].data(), parts[p].size());
+        return positions;
+    }
+
+    //---------------------------------------------------
+
+    std::vector<ValueType> bounds;
+    std::vector<Channel> channels;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType>
+PartitionServer<ValueType>::PartitionServer(const std::string& prefix, std::vector<ValueType> bounds)
+    : prefix(prefix), bounds(std::move(bounds)) {
+    try {
+        for (size_t i = 0; i <= this->bounds.size(); ++i) {
+            int listenFd = UnixSocket::listen(partitionPath(prefix, i));
+            pid_t pid = ::fork();
+            if (pid < 0) {
+                int error = errno;
+                ::close(listenFd);
+                throw std::system_error(error, std::generic_category(), "fork");
+            }
+            if (pid == 0) {
+#ifdef __linux__
+                ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+                serve(listenFd);
+            }
+            ::close(listenFd);
+            children.push_back(pid);
+        }
+    } catch (...) {
+        stop();
+        throw;
+    }
+}
+
+template<typename ValueType>
+PartitionServer<ValueType>::~PartitionServer() {
+    stop();
+}
+
+template<typename ValueType>
+size_t PartitionServer<ValueType>::partitions() const {
+    return bounds.size() + 1;
+}
+
+template<typename ValueType>
+PartitionClient<ValueType>::PartitionClient(const std::string& prefix, std::vector<ValueType> bounds)
+    : bounds(std::move(bounds)), channels(this->bounds.size() + 1) {
+    try {
+        for (size_t i = 0; i < channels.size(); ++i)
+            channels[i].fd = UnixSocket::connect(partitionPath(prefix, i));
+    } catch (...) {
+        for (Channel& channel : channels)
+            if (channel.fd >= 0)
+                ::close(channel.fd);
+        throw;
+    }
+}
+
+template<typename ValueType>
+PartitionClient<ValueType>::~PartitionClient() {
+    for (Channel& channel : channels)
+        ::close(channel.fd);
+}
+
+template<typename ValueType>
+void PartitionClient<ValueType>::insert(const std::vector<ValueType>& keys) {
+    split(PartitionOp::kInsert, keys);
+    exchange();
+}
+
+template<typename ValueType>
+void PartitionClient<ValueType>::erase(const std::vector<ValueType>& keys) {
+    split(PartitionOp::kErase, keys);
+    exchange();
+}
+
+template<typename ValueType>
+std::vector<bool> PartitionClient<ValueType>::contains(const std::vector<ValueType>& keys) {
+    std::vector<size_t> positions = split(PartitionOp::kFind, keys);
+    exchange();
+
+    std::vector<bool> result(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+        result[i] = answer(channels[partitionOf(keys[i])], 0).second[positions[i]];
+    return result;
+}
+
+template<typename ValueType>
+std::vector<std::pair<bool, ValueType>> PartitionClient<ValueType>::lower_bound(const std::vector<ValueType>& keys) {
+    std::vector<size_t> positions = split(PartitionOp::kLowerBound, keys);
+    exchange();
+
+    std::vector<std::pair<bool, ValueType>> result(keys.size());
+    bool missed = false;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto [count, payload] = answer(channels[partitionOf(keys[i])], 0);
+        result[i].first = payload[positions[i]];
+        if (result[i].first)
+            std::memcpy(&result[i].second, payload + count + positions[i] * sizeof(ValueType), sizeof(ValueType));
+        missed |= !result[i].first;
+    }
+    if (!missed)
+        return result;
+
+    // The answer to a miss is the least key of the next non-empty partition
+    for (size_t p = 1; p < channels.size(); ++p)
+        request(p, PartitionOp::kLowerBound, &bounds[p - 1], 1);
+    exchange();
+
+    std::vector<std::pair<bool, ValueType>> minima(channels.size());
+    for (size_t p = 1; p < channels.size(); ++p) {
+        auto [count, payload] = answer(channels[p], 0);
+        minima[p].first = payload[0];
+        if (minima[p].first)
+            std::memcpy(&minima[p].second, payload + count, sizeof(ValueType));
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+        for (size_t p = partitionOf(keys[i]) + 1; !result[i].first && p < channels.size(); ++p)
+            result[i] = minima[p];
+    }
+    return result;
+}
+
+template<typename ValueType>
+std::vector<ValueType> PartitionClient<ValueType>::scan(const ValueType& from, size_t limit) {
+    std::vector<ValueType> result;
+    if (!limit)
+        return result;
+
+    // Partitions are disjoint ranges, so merging is concatenation
+    size_t first = partitionOf(from);
+    for (size_t p = first; p < channels.size() && result.size() < limit; ++p) {
+        uint32_t shortfall = std::min<size_t>(limit - result.size(), UINT32_MAX);
+        request(p, PartitionOp::kScan, p == first ? &from : &bounds[p - 1], 1, shortfall);
+        exchange();
+
+        auto [count, payload] = answer(channels[p], 0);
+        if (!count)
+            continue;
+        size_t at = result.size();
+        result.resize(at + count);
+        std::memcpy(result.data() + at, payload, count * sizeof(ValueType));
+    }
+    return result;
+}
+
+template<typename ValueType>
+size_t PartitionClient<ValueType>::partitions() const {
+    return channels.size();
+}
@@ -0,0 +1,349 @@
+/*-------------------------------------------------------
+
+    Mutable set whose whole state is one OffsetTree region
+    Growing it is a plain realloc, saving it is a write of
+    the region and a saved file can be mmap'd back and used
+    (and modified, copy-on-write) without any fix-ups.
+    Keys must be trivially copyable
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "offset_tree.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+template <typename ValueType>
+class RelocatableSet {
+public:
+    //---------------------------------------------------
+    // constructors & operator= & destructor
+
+    explicit RelocatableSet(size_t capacity = 16);
+    // Copies a region obtained from data() or a saved file
+    RelocatableSet(const char* data, size_t length);
+    RelocatableSet(RelocatableSet&& other) noexcept;
+
+    RelocatableSet& operator=(RelocatableSet&& other) noexcept;
+
+    ~RelocatableSet();
+
+    // Reads a file written by save()
+    static RelocatableSet load(const std::string& path);
+
+    // Maps a file written by save() privately, nothing is read up front
+    // and changes never reach the file
+    static RelocatableSet map(const std::string& path);
+
+    //---------------------------------------------------
+    // Methods
+
+    size_t size() const;
+
+    bool empty() const;
+
+    void insert(const ValueType& value);
+
+    void erase(const ValueType& value);
+
+    void clear();
+
+    // The region, valid until the next insert
+    const char* data() const;
+
+    size_t bytes() const;
+
+    // Writes the region trimmed to the nodes in use
+    void save(const std::string& path) const;
+
+    //---------------------------------------------------
+    // iterators
+
+    // Stays valid across inserts and erases, see KeyCursor
+    using iterator = KeyCursor<RelocatableSet<ValueType>, ValueType>;
+
+    iterator begin() const;
+
+    iterator end() const;
+
+    //---------------------------------------------------
+    // Search methods
+
+    iterator find(const ValueType& key) const;
+
+    iterator lower_bound(const ValueType& key) const;
+
+    iterator upper_bound(const ValueType& key) const;
+
+    bool contains(const ValueType& key) const;
+
+private:
+    using Tree = OffsetTree<ValueType>;
+
+    RelocatableSet(char* region, size_t length, bool mapped) : tree(region), length(length), mapped(mapped) {}
+
+    static void check(bool ok, const char* what) {
+        if (!ok)
+            throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    static int openFile(const std::string& path, size_t& length) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        check(fd >= 0, "open");
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            check(false, "fstat");
+        }
+        length = size_t(info.st_size);
+        return fd;
+    }
+
+    // Length of the region cut right after the last node in use
+    size_t usedBytes() const {
+        const typename Tree::Header* h = tree.header();
+        return h->nodes + h->used * sizeof(typename Tree::Node);
+    }
+
+    // Doubles the capacity, moving a mapped region to the heap
+    void grow() {
+        size_t capacity = std::max<size_t>(tree.header()->capacity * 2, 16);
+        size_t grown = tree.header()->nodes + capacity * sizeof(typename Tree::Node);
+
+        char* region;
+        if (mapped) {
+            region = static_cast<char*>(std::malloc(grown));
+            if (!region)
+                throw std::bad_alloc();
+            std::memcpy(region, tree.data(), usedBytes());
+            ::munmap(tree.data(), length);
+            mapped = false;
+        } else {
+            region = static_cast<char*>(std::realloc(tree.data(), grown));
+            if (!region)
+                throw std::bad_alloc();
+        }
+
+        tree.rebase(region);
+        tree.grow(capacity);
+        length = grown;
+    }
+
+    void release() {
+        if (!tree.data())
+            return;
+        if (mapped)
+            ::munmap(tree.data(), length);
+        else
+            std::free(tree.data());
+        tree.rebase(nullptr);
+    }
+
+    //---------------------------------------------------
+
+    Tree tree;
+    size_t length = 0;
+    bool mapped = false;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType>
+RelocatableSet<ValueType>::RelocatableSet(size_t capacity) {
+    length = Tree::regionSize(0, capacity);
+    char* region = static_cast<char*>(std::malloc(length));
+    if (!region)
+        throw std::bad_alloc();
+    Tree::format(region, 0, capacity);
+    tree.rebase(region);
+}
+
+template<typename ValueType>
+RelocatableSet<ValueType>::RelocatableSet(const char* data, size_t length) : length(length) {
+    if (!Tree::valid(data, length))
+        throw std::runtime_error("RelocatableSet: not a region of this key type");
+    char* region = static_cast<char*>(std::malloc(length));
+    if (!region)
+        throw std::bad_alloc();
+    std::memcpy(region, data, length);
+    tree.rebase(region);
+}
+
+template<typename ValueType>
+RelocatableSet<ValueType>::RelocatableSet(RelocatableSet&& other) noexcept
+    : tree(other.tree), length(other.length), mapped(other.mapped) {
+    other.tree.rebase(nullptr);
+}
+
+template<typename ValueType>
+RelocatableSet<ValueType>& RelocatableSet<ValueType>::operator=(RelocatableSet&& other) noexcept {
+    if (this != &other) {
+        release();
+        tree = other.tree;
+        length = other.length;
+        mapped = other.mapped;
+        other.tree.rebase(nullptr);
+    }
+    return *this;
+}
+
+template<typename ValueType>
+RelocatableSet<ValueType>::~RelocatableSet() {
+    release();
+}
+
+template<typename ValueType>
+RelocatableSet<ValueType> RelocatableSet<ValueType>::load(const std::string& path) {
+    size_t length;
+    int fd = openFile(path, length);
+    char* region = static_cast<char*>(std::malloc(std::max<size_t>(length, 1)));
+    size_t done = 0;
+    while (region && done < length) {
+        ssize_t got = ::read(fd, region + done, length - done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        done += got;
+    }
+    ::close(fd);
+
+    if (!region)
+        throw std::bad_alloc();
+    if (done < length || !Tree::valid(region, length)) {
+        std::free(region);
+        throw std::runtime_error("RelocatableSet: " + path + " is not a set of this key type");
+    }
+    return RelocatableSet(region, length, false);
+}
+
+template<typename ValueType>
+RelocatableSet<ValueType> RelocatableSet<ValueType>::map(const std::string& path) {
+    size_t length;
+    int fd = openFile(path, length);
+    void* place = length ? ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (place == MAP_FAILED || !Tree::valid(static_cast<char*>(place), length)) {
+        if (place != MAP_FAILED)
+            ::munmap(place, length);
+        throw std::runtime_error("RelocatableSet: " + path + " is not a set of this key type");
+    }
+    return RelocatableSet(static_cast<char*>(place), length, true);
+}
+
+template<typename ValueType>
+size_t RelocatableSet<ValueType>::size() const {
+    return tree.size();
+}
+
+template<typename ValueType>
+bool RelocatableSet<ValueType>::empty() const {
+    return size() == 0;
+}
+
+template<typename ValueType>
+void RelocatableSet<ValueType>::insert(const ValueType& value) {
+    if (tree.full() && !contains(value))
+        grow();
+    tree.insert(value);
+}
+
+template<typename ValueType>
+void RelocatableSet<ValueType>::erase(const ValueType& value) {
+    tree.erase(value);
+}
+
+template<typename ValueType>
+void RelocatableSet<ValueType>::clear() {
+    tree.clear();
+}
+
+template<typename ValueType>
+const char* RelocatableSet<ValueType>::data() const {
+    return tree.data();
+}
+
+template<typename ValueType>
+size_t RelocatableSet<ValueType>::bytes() const {
+    return length;
+}
+
+template<typename ValueType>
+void RelocatableSet<ValueType>::save(const std::string& path) const {
+    // Links are relative to themselves, so the header goes out in place
+    // and only its capacity is cut down to the nodes written
+    uint64_t capacity = tree.header()->used;
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    check(fd >= 0, "open");
+    auto writeAll = [fd](const char* bytes, size_t count) {
+        while (count) {
+            ssize_t written = ::write(fd, bytes, count);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0)
+                return false;
+            bytes += written;
+            count -= written;
+        }
+        return true;
+    };
+
+    bool ok = writeAll(tree.data(), usedBytes()) &&
+              ::pwrite(fd, &capacity, sizeof(capacity), offsetof(typename Tree::Header, capacity)) == sizeof(capacity);
+    int error = errno;
+    ::close(fd);
+    errno = error;
+    check(ok, "write");
+}
+
+template<typename ValueType>
+typename RelocatableSet<ValueType>::iterator RelocatableSet<ValueType>::begin() const {
+    return iterator(this, tree.min());
+}
+
+template<typename ValueType>
+typename RelocatableSet<ValueType>::iterator RelocatableSet<ValueType>::end() const {
+    return iterator(this, nullptr);
+}
+
+template<typename ValueType>
+typename RelocatableSet<ValueType>::iterator RelocatableSet<ValueType>::find(const ValueType& key) const {
+    iterator it = lower_bound(key);
+    return it != end() && !(key < *it) ? it : end();
+}
+
+template<typename ValueType>
+typename RelocatableSet<ValueType>::iterator RelocatableSet<ValueType>::lower_bound(const ValueType& key) const {
+    return iterator(this, tree.lowerBound(key, false));
+}
+
+template<typename ValueType>
+typename RelocatableSet<ValueType>::iterator RelocatableSet<ValueType>::upper_bound(const ValueType& key) const {
+    return iterator(this, tree.lowerBound(key, true));
+}
+
+template<typename ValueType>
+bool RelocatableSet<ValueType>::contains(const ValueType& key) const {
+    return find(key) != end();
+}
@@ -0,0 +1,500 @@
+/*-------------------------------------------------------
+
+    Replication of a Set over Unix domain sockets
+    ReplicatedSet is the primary: it listens on a socket path,
+    sends every follower a snapshot and then its changes, in
+    frames of up to kFrameKeys keys of one kind. The snapshot
+    is read from the set a frame at a time while changes keep
+    queueing behind it. A follower that falls maxPending
+    changes behind stalls the writers.
+    SetReplica connects to the path and keeps a local copy
+    that serves reads. Keys must be trivially copyable
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "change_stream.h"
+#include "unix_socket.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*-------------------------------------------------------
+    Wire format
+-------------------------------------------------------*/
+
+struct ReplicationFrame {
+    static constexpr uint32_t kFrameKeys = 4096;
+
+    uint64_t sequence;  // primary sequence once the frame is applied, 0 inside a batch
+    uint32_t count;     // keys following the header
+    ChangeOp op;
+    uint8_t padding[3];
+};
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+template <typename ValueType>
+class ReplicatedSet : private SetObserver<ValueType> {
+public:
+    static_assert(std::is_trivially_copyable<ValueType>::value, "ReplicatedSet keys are sent as raw bytes");
+
+    //---------------------------------------------------
+    // constructors & destructor
+
+    // Listens on path, replacing a stale socket file
+    explicit ReplicatedSet(const std::string& path, size_t maxPending = 1 << 16);
+
+    ReplicatedSet(const ReplicatedSet&) = delete;
+    ReplicatedSet& operator=(const ReplicatedSet&) = delete;
+
+    // Disconnects the followers and removes the socket file
+    ~ReplicatedSet();
+
+    //---------------------------------------------------
+    // Methods
+
+    void insert(const ValueType& value);
+
+    void erase(const ValueType& value);
+
+    void clear();
+
+    // Runs fn(Set<ValueType>&) as one write, e.g. a transaction
+    template<typename Function>
+    void write(Function fn);
+
+    // Runs fn(const Set<ValueType>&) under the lock
+    template<typename Function>
+    void read(Function fn) const;
+
+    size_t size() const;
+
+    bool contains(const ValueType& key) const;
+
+    // Changes made so far, followers report how many they applied
+    uint64_t sequence() const;
+
+    size_t followers() const;
+
+private:
+    struct Follower {
+        int fd = -1;
+        bool gone = false;
+        std::vector<std::pair<ChangeOp, ValueType>> pending;
+        uint64_t pendingSequence = 0;  // sequence after the last pending change
+        bool snapshot = true;          // keys above sent remain to be sent
+        bool sentAny = false;
+        ValueType sent{};              // last snapshot key sent
+        std::thread sender;
+    };
+
+    void inserted(const ValueType& key) override {
+        record(ChangeOp::kInsert, key);
+    }
+
+    void erased(const ValueType& key) override {
+        record(ChangeOp::kErase, key);
+    }
+
+    void cleared() override {
+        record(ChangeOp::kClear, ValueType{});
+    }
+
+    // The caller holds the lock
+    void record(ChangeOp op, const ValueType& key) {
+        ++changes;
+        for (auto& follower : followerList) {
+            if (follower->gone)
+                continue;
+            follower->pending.emplace_back(op, key);
+            follower->pendingSequence = changes;
+        }
+        ready.notify_all();
+    }
+
+    // Waits until every follower has room, the caller holds the lock
+    void admit(std::unique_lock<std::mutex>& lock) {
+        drained.wait(lock, [this] {
+            for (const auto& follower : followerList)
+                if (!follower->gone && follower->pending.size() >= maxPending)
+                    return stopping;
+            return true;
+        });
+    }
+
+    void accept() {
+        while (true) {
+            int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd < 0 && errno == EINTR)
+                continue;
+            if (fd < 0)
+                return;
+
+            std::vector<std::unique_ptr<Follower>> dead;
+            std::unique_lock<std::mutex> lock(mutex);
+            if (stopping) {
+                ::close(fd);
+                return;
+            }
+            takeGone(dead);
+            auto follower = std::make_unique<Follower>();
+            follower->fd = fd;
+            // The snapshot starts from an empty copy, send() reads the keys
+            follower->pending.emplace_back(ChangeOp::kClear, ValueType{});
+            follower->pendingSequence = changes;
+            follower->sender = std::thread(&ReplicatedSet::send, this, follower.get());
+            followerList.push_back(std::move(follower));
+            lock.unlock();
+
+            for (auto& old : dead) {
+                old->sender.join();
+                ::close(old->fd);
+            }
+        }
+    }
+
+    // Moves disconnected followers to dead, the caller holds the lock. Their
+    // senders set gone as the last thing under the lock, so joining them
+    // afterwards does not wait on anything
+    void takeGone(std::vector<std::unique_ptr<Follower>>& dead) {
+        auto live = std::stable_partition(followerList.begin(), followerList.end(),
+                                          [](const auto& follower) { return !follower->gone; });
+        std::move(live, followerList.end(), std::back_inserter(dead));
+        followerList.erase(live, followerList.end());
+    }
+
+    // Appends the next kFrameKeys snapshot keys to batch, the caller holds the lock.
+    // Every change is queued as well, so a key already sent gets its later changes
+    // and one not sent yet is read as it is by the time its turn comes
+    void snapshotChunk(Follower* follower, std::vector<std::pair<ChangeOp, ValueType>>& batch) {
+        auto it = follower->sentAny ? set.lower_bound(follower->sent) : set.begin();
+        if (follower->sentAny && it != set.end() && !(follower->sent < *it))
+            ++it;
+        for (size_t n = 0; n < ReplicationFrame::kFrameKeys && it != set.end(); ++n, ++it)
+            batch.emplace_back(ChangeOp::kInsert, *it);
+
+        if (it == set.end()) {
+            follower->snapshot = false;
+        } else if (!batch.empty()) {
+            follower->sent = batch.back().second;
+            follower->sentAny = true;
+        }
+    }
+
+    void send(Follower* follower) {
+        std::vector<std::pair<ChangeOp, ValueType>> batch;
+        std::vector<char> buffer;
+        while (true) {
+            uint64_t sequence;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&] { return stopping || follower->snapshot || !follower->pending.empty(); });
+                if (stopping)
+                    return;
+                batch.clear();
+                batch.swap(follower->pending);
+                if (follower->snapshot)
+                    snapshotChunk(follower, batch);
+                // The copy only reflects a sequence once the snapshot is complete
+                sequence = follower->snapshot ? 0 : follower->pendingSequence;
+                drained.notify_all();
+            }
+
+            buffer.clear();
+            for (size_t i = 0; i < batch.size();) {
+                ChangeOp op = batch[i].first;
+                size_t end = i + 1;
+                while (op != ChangeOp::kClear && end < batch.size() && end - i < ReplicationFrame::kFrameKeys &&
+                       batch[end].first == op)
+                    ++end;
+
+                ReplicationFrame frame = {};
+                frame.sequence = end == batch.size() ? sequence : 0;
+                frame.count = op == ChangeOp::kClear ? 0 : end - i;
+                frame.op = op;
+                const char* header = reinterpret_cast<const char*>(&frame);
+                buffer.insert(buffer.end(), header, header + sizeof(frame));
+                for (size_t j = i; j < i + frame.count; ++j) {
+                    const char* key = reinterpret_cast<const char*>(&batch[j].second);
+                    buffer.insert(buffer.end(), key, key + sizeof(ValueType));
+                }
+                i = end;
+            }
+            if (batch.empty()) {
+                // The snapshot ended right after a full frame, its sequence still goes out
+                ReplicationFrame frame = {};
+                frame.sequence = sequence;
+                frame.op = ChangeOp::kInsert;
+                const char* header = reinterpret_cast<const char*>(&frame);
+                buffer.insert(buffer.end(), header, header + sizeof(frame));
+            }
+
+            if (!UnixSocket::sendAll(follower->fd, buffer.data(), buffer.size())) {
+                std::lock_guard<std::mutex> lock(mutex);
+                follower->gone = true;
+                follower->snapshot = false;
+                follower->pending.clear();
+                drained.notify_all();
+                return;
+            }
+        }
+    }
+
+    //---------------------------------------------------
+
+    std::string path;
+    size_t maxPending;
+    int listenFd = -1;
+
+    mutable std::mutex mutex;
+    std::condition_variable ready;    // a follower has something to send
+    std::condition_variable drained;  // a follower took its pending changes
+    bool stopping = false;
+    uint64_t changes = 0;
+    Set<ValueType> set;
+    std::vector<std::unique_ptr<Follower>> followerList;
+
+    std::thread acceptor;
+};
+
+template <typename ValueType>
+class SetReplica {
+public:
+    static_assert(std::is_trivially_copyable<ValueType>::value, "SetReplica keys are sent as raw bytes");
+
+    //---------------------------------------------------
+    // constructors & destructor
+
+    // Connects to the primary listening on path
+    explicit SetReplica(const std::string& path);
+
+    SetReplica(const SetReplica&) = delete;
+    SetReplica& operator=(const SetReplica&) = delete;
+
+    ~SetReplica();
+
+    //---------------------------------------------------
+    // Methods, reads only see what has arrived so far
+
+    size_t size() const;
+
+    bool contains(const ValueType& key) const;
+
+    // Runs fn(const Set<ValueType>&) under the read lock
+    template<typename Function>
+    void read(Function fn) const;
+
+    // Primary sequence the copy reflects
+    uint64_t sequence() const;
+
+    // Blocks until the copy reflects sequence, false if the primary went away first
+    bool wait(uint64_t sequence) const;
+
+    bool connected() const;
+
+private:
+    void receive() {
+        std::vector<ValueType> keys;
+        ReplicationFrame frame;
+        while (UnixSocket::receiveAll(fd, reinterpret_cast<char*>(&frame), sizeof(frame))) {
+            if (frame.count > ReplicationFrame::kFrameKeys)
+                break;
+            keys.resize(frame.count);
+            if (!UnixSocket::receiveAll(fd, reinterpret_cast<char*>(keys.data()), keys.size() * sizeof(ValueType)))
+                break;
+
+            {
+                std::unique_lock<std::shared_mutex> lock(mutex);
+                if (frame.op == ChangeOp::kClear) {
+                    set.clear();
+                } else {
+                    auto tx = set.transaction();
+                    for (const ValueType& key : keys) {
+                        if (frame.op == ChangeOp::kInsert)
+                            tx.insert(key);
+                        else
+                            tx.erase(key);
+                    }
+                    tx.commit();
+                }
+            }
+
+            if (frame.sequence) {
+                std::lock_guard<std::mutex> lock(progressMutex);
+                applied = frame.sequence;
+                progress.notify_all();
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(progressMutex);
+        disconnected = true;
+        progress.notify_all();
+    }
+
+    //---------------------------------------------------
+
+    int fd = -1;
+
+    mutable std::shared_mutex mutex;
+    Set<ValueType> set;
+
+    mutable std::mutex progressMutex;
+    mutable std::condition_variable progress;
+    uint64_t applied = 0;
+    bool disconnected = false;
+
+    std::thread receiver;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType>
+ReplicatedSet<ValueType>::ReplicatedSet(const std::string& path, size_t maxPending)
+    : path(path), maxPending(std::max<size_t>(maxPending, 1)) {
+    listenFd = UnixSocket::listen(path);
+    set.observe(this);
+    acceptor = std::thread(&ReplicatedSet::accept, this);
+}
+
+template<typename ValueType>
+ReplicatedSet<ValueType>::~ReplicatedSet() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        ready.notify_all();
+        drained.notify_all();
+    }
+    ::shutdown(listenFd, SHUT_RDWR);
+    acceptor.join();
+    ::close(listenFd);
+    ::unlink(path.c_str());
+
+    // Shutting the sockets down first wakes senders stuck on a full socket
+    for (auto& follower : followerList)
+        ::shutdown(follower->fd, SHUT_RDWR);
+    for (auto& follower : followerList) {
+        follower->sender.join();
+        ::close(follower->fd);
+    }
+}
+
+template<typename ValueType>
+void ReplicatedSet<ValueType>::insert(const ValueType& value) {
+    write([&](Set<ValueType>& set) { set.insert(value); });
+}
+
+template<typename ValueType>
+void ReplicatedSet<ValueType>::erase(const ValueType& value) {
+    write([&](Set<ValueType>& set) { set.erase(value); });
+}
+
+template<typename ValueType>
+void ReplicatedSet<ValueType>::clear() {
+    write([](Set<ValueType>& set) { set.clear(); });
+}
+
+template<typename ValueType>
+template<typename Function>
+void ReplicatedSet<ValueType>::write(Function fn) {
+    std::unique_lock<std::mutex> lock(mutex);
+    admit(lock);
+    fn(set);
+}
+
+template<typename ValueType>
+template<typename Function>
+void ReplicatedSet<ValueType>::read(Function fn) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    fn(static_cast<const Set<ValueType>&>(set));
+}
+
+template<typename ValueType>
+size_t ReplicatedSet<ValueType>::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return set.size();
+}
+
+template<typename ValueType>
+bool ReplicatedSet<ValueType>::contains(const ValueType& key) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return set.find(key) != set.end();
+}
+
+template<typename ValueType>
+uint64_t ReplicatedSet<ValueType>::sequence() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return changes;
+}
+
+template<typename ValueType>
+size_t ReplicatedSet<ValueType>::followers() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t result = 0;
+    for (const auto& follower : followerList)
+        result += !follower->gone;
+    return result;
+}
+
+template<typename ValueType>
+SetReplica<ValueType>::SetReplica(const std::string& path) {
+    fd = UnixSocket::connect(path);
+    receiver = std::thread(&SetReplica::receive, this);
+}
+
+template<typename ValueType>
+SetReplica<ValueType>::~SetReplica() {
+    ::shutdown(fd, SHUT_RDWR);
+    receiver.join();
+    ::close(fd);
+}
+
+template<typename ValueType>
+size_t SetReplica<ValueType>::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return set.size();
+}
+
+template<typename ValueType>
+bool SetReplica<ValueType>::contains(const ValueType& key) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return set.find(key) != set.end();
+}
+
+template<typename ValueType>
+template<typename Function>
+void SetReplica<ValueType>::read(Function fn) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    fn(set);
+}
+
+template<typename ValueType>
+uint64_t SetReplica<ValueType>::sequence() const {
+    std::lock_guard<std::mutex> lock(progressMutex);
+    return applied;
+}
+
+template<typename ValueType>
+bool SetReplica<ValueType>::wait(uint64_t sequence) const {
+    std::unique_lock<std::mutex> lock(progressMutex);
+    progress.wait(lock, [&] { return applied >= sequence || disconnected; });
+    return applied >= sequence;
+}
+
+template<typename ValueType>
+bool SetReplica<ValueType>::connected() const {
+    std::lock_guard<std::mutex> lock(progressMutex);
+    return !disconnected;
+}
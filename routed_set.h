@@ -0,0 +1,290 @@
+/*-------------------------------------------------------
+
+    Read-mostly Set with its top levels replicated per core
+    Every lookup passes the root and the first few levels, so
+    each core keeps its own compact copy of the top levels
+    (keys in BFS order and the subtrees below them) and only
+    touches shared nodes once it is routed past them. Readers
+    lock their core's replica, writers lock all of them
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+// NodeAlignment is passed on to the Set, kCacheLineSize keeps the shared
+// top levels that every core routes through off each other's lines
+template <typename ValueType, size_t NodeAlignment = 0>
+class RoutedSet {
+public:
+    //---------------------------------------------------
+    // constructors
+
+    // Replicates the top levels of the tree, replicas == 0 means
+    // one per hardware thread
+    explicit RoutedSet(size_t levels = 5, size_t replicas = 0);
+
+    RoutedSet(const RoutedSet&) = delete;
+    RoutedSet& operator=(const RoutedSet&) = delete;
+
+    //---------------------------------------------------
+    // Methods
+
+    // Writers lock every replica and refresh them when a rotation
+    // reached the top levels
+    void insert(const ValueType& value);
+
+    void erase(const ValueType& value);
+
+    void clear();
+
+    size_t size() const;
+
+    bool empty() const;
+
+    bool contains(const ValueType& key) const;
+
+    // Runs fn(const Set<ValueType, NodeAlignment>&) under a read lock
+    template<typename Function>
+    void read(Function fn) const;
+
+    //---------------------------------------------------
+    // iterators
+
+    // Stays valid across writers, see KeyCursor
+    using iterator = KeyCursor<RoutedSet<ValueType, NodeAlignment>, ValueType>;
+
+    iterator begin() const;
+
+    iterator end() const;
+
+    //---------------------------------------------------
+    // Search methods
+
+    iterator find(const ValueType& key) const;
+
+    iterator lower_bound(const ValueType& key) const;
+
+    iterator upper_bound(const ValueType& key) const;
+
+private:
+    using TreeNode = typename Set<ValueType, NodeAlignment>::TreeNode;
+    using KeyCache = typename Set<ValueType, NodeAlignment>::KeyCache;
+
+    // Top levels in BFS order: children of slot i are 2i+1 and 2i+2,
+    // slots past the top continue in subtrees
+    struct alignas(kCacheLineSize) Replica {
+        mutable std::shared_mutex mutex;
+        std::vector<ValueType> keys;
+        std::vector<TreeNode*> nodes;     // nullptr where the tree is shallower
+        std::vector<TreeNode*> subtrees;
+    };
+
+    struct Route {
+        TreeNode* match = nullptr;    // key is in the top levels
+        TreeNode* subtree = nullptr;  // otherwise it can only be here
+        TreeNode* bound = nullptr;    // least top level key greater than key
+    };
+
+    const Replica& localReplica() const {
+        size_t cpu = 0;
+#ifdef __linux__
+        int current = sched_getcpu();
+        if (current >= 0)
+            cpu = current;
+        else
+#endif
+            cpu = std::hash<std::thread::id>()(std::this_thread::get_id());
+        return replicas[cpu % replicaCount];
+    }
+
+    Route route(const Replica& replica, const ValueType& key) const {
+        Route result;
+        size_t i = 0, top = replica.nodes.size();
+        while (i < top) {
+            if (!replica.nodes[i])
+                return result;
+            if (key < replica.keys[i]) {
+                result.bound = replica.nodes[i];
+                i = 2 * i + 1;
+            } else if (replica.keys[i] < key) {
+                i = 2 * i + 2;
+            } else {
+                result.match = replica.nodes[i];
+                return result;
+            }
+        }
+        result.subtree = replica.subtrees[i - top];
+        return result;
+    }
+
+    // Least key >= key (> key when strict), the caller holds the replica's lock
+    const ValueType* lowerBound(const Replica& replica, const ValueType& key, bool strict) const {
+        Route found = route(replica, key);
+        TreeNode* t = found.match;
+        if (!t) {
+            t = set.AVLLowerBound(found.subtree, key, KeyCache(key));
+            if (!t)
+                t = found.bound;
+        }
+        if (!t)
+            return nullptr;
+        typename Set<ValueType, NodeAlignment>::iterator it(t, &set);
+        if (strict && !(key < t->key))
+            ++it;
+        return it != set.end() ? &*it : nullptr;
+    }
+
+    // Copies the current top levels into every replica unless they are
+    // unchanged, the caller holds every replica lock
+    void refresh() {
+        size_t top = (size_t(1) << levels) - 1;
+        std::vector<TreeNode*> nodes(2 * top + 1, nullptr);
+        nodes[0] = set.root();
+        for (size_t i = 0; i < top; ++i) {
+            if (nodes[i]) {
+                nodes[2 * i + 1] = nodes[i]->left;
+                nodes[2 * i + 2] = nodes[i]->right;
+            }
+        }
+
+        const Replica& current = replicas[0];
+        bool same = current.nodes.size() == top;
+        for (size_t i = 0; same && i < nodes.size(); ++i) {
+            TreeNode* known = i < top ? current.nodes[i] : current.subtrees[i - top];
+            // A freed node may come back from the arena with another key
+            same = known == nodes[i] && (i >= top || !known ||
+                   (!(known->key < current.keys[i]) && !(current.keys[i] < known->key)));
+        }
+        if (same)
+            return;
+
+        for (size_t r = 0; r < replicaCount; ++r) {
+            Replica& replica = replicas[r];
+            replica.nodes.assign(nodes.begin(), nodes.begin() + top);
+            replica.subtrees.assign(nodes.begin() + top, nodes.end());
+            replica.keys.assign(top, ValueType{});
+            for (size_t i = 0; i < top; ++i)
+                if (nodes[i])
+                    replica.keys[i] = nodes[i]->key;
+        }
+    }
+
+    template<typename Function>
+    void write(Function fn) {
+        std::vector<std::unique_lock<std::shared_mutex>> locks;
+        locks.reserve(replicaCount);
+        for (size_t r = 0; r < replicaCount; ++r)
+            locks.emplace_back(replicas[r].mutex);
+        fn();
+        refresh();
+    }
+
+    //---------------------------------------------------
+
+    size_t levels;
+    size_t replicaCount;
+    std::unique_ptr<Replica[]> replicas;
+    Set<ValueType, NodeAlignment> set;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType, size_t NodeAlignment>
+RoutedSet<ValueType, NodeAlignment>::RoutedSet(size_t levels, size_t replicas)
+    : levels(std::min<size_t>(std::max<size_t>(levels, 1), 16)),
+      replicaCount(replicas ? replicas : std::max(1u, std::thread::hardware_concurrency())),
+      replicas(new Replica[replicaCount]) {
+    refresh();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+void RoutedSet<ValueType, NodeAlignment>::insert(const ValueType& value) {
+    write([&] { set.insert(value); });
+}
+
+template<typename ValueType, size_t NodeAlignment>
+void RoutedSet<ValueType, NodeAlignment>::erase(const ValueType& value) {
+    write([&] { set.erase(value); });
+}
+
+template<typename ValueType, size_t NodeAlignment>
+void RoutedSet<ValueType, NodeAlignment>::clear() {
+    write([&] { set.clear(); });
+}
+
+template<typename ValueType, size_t NodeAlignment>
+size_t RoutedSet<ValueType, NodeAlignment>::size() const {
+    std::shared_lock<std::shared_mutex> lock(localReplica().mutex);
+    return set.size();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+bool RoutedSet<ValueType, NodeAlignment>::empty() const {
+    return size() == 0;
+}
+
+template<typename ValueType, size_t NodeAlignment>
+bool RoutedSet<ValueType, NodeAlignment>::contains(const ValueType& key) const {
+    const Replica& replica = localReplica();
+    std::shared_lock<std::shared_mutex> lock(replica.mutex);
+    Route found = route(replica, key);
+    return found.match || set.AVLFind(found.subtree, key, KeyCache(key));
+}
+
+template<typename ValueType, size_t NodeAlignment>
+template<typename Function>
+void RoutedSet<ValueType, NodeAlignment>::read(Function fn) const {
+    std::shared_lock<std::shared_mutex> lock(localReplica().mutex);
+    fn(set);
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename RoutedSet<ValueType, NodeAlignment>::iterator RoutedSet<ValueType, NodeAlignment>::begin() const {
+    std::shared_lock<std::shared_mutex> lock(localReplica().mutex);
+    auto it = set.begin();
+    return iterator(this, it != set.end() ? &*it : nullptr);
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename RoutedSet<ValueType, NodeAlignment>::iterator RoutedSet<ValueType, NodeAlignment>::end() const {
+    return iterator(this, nullptr);
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename RoutedSet<ValueType, NodeAlignment>::iterator RoutedSet<ValueType, NodeAlignment>::find(const ValueType& key) const {
+    iterator it = lower_bound(key);
+    return it != end() && !(key < *it) ? it : end();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename RoutedSet<ValueType, NodeAlignment>::iterator RoutedSet<ValueType, NodeAlignment>::lower_bound(const ValueType& key) const {
+    const Replica& replica = localReplica();
+    std::shared_lock<std::shared_mutex> lock(replica.mutex);
+    return iterator(this, lowerBound(replica, key, false));
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename RoutedSet<ValueType, NodeAlignment>::iterator RoutedSet<ValueType, NodeAlignment>::upper_bound(const ValueType& key) const {
+    const Replica& replica = localReplica();
+    std::shared_lock<std::shared_mutex> lock(replica.mutex);
+    return iterator(this, lowerBound(replica, key, true));
+}
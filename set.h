@@ -9,19 +9,347 @@
 #pragma once
 
 #include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <initializer_list>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 /*-------------------------------------------------------
-    Class declaration
+    Key prefix cache
+    Nodes keep KeyPrefix<ValueType>::Cache next to the key,
+    comparing two caches must agree with operator< whenever
+    it returns non-zero. The default caches nothing.
+-------------------------------------------------------*/
+
+template <typename ValueType>
+struct KeyPrefix {
+    struct Cache {
+        explicit Cache(const ValueType&) {}
+
+        int compare(const Cache&) const {
+            return 0;
+        }
+    };
+};
+
+// First 8 bytes, big-endian and zero padded, so integer order matches
+// the byte-wise order of strings up to the point where one of them ends
+struct StringKeyPrefix {
+    struct Cache {
+        explicit Cache(std::string_view key) : bits(load(key.data(), key.size())) {}
+
+        int compare(const Cache& other) const {
+            return bits < other.bits ? -1 : (other.bits < bits ? +1 : 0);
+        }
+
+        static uint64_t load(const char* data, size_t size) {
+            unsigned char bytes[8] = {};
+            if (size)
+                std::memcpy(bytes, data, std::min<size_t>(size, 8));
+
+            uint64_t result = 0;
+            for (unsigned char byte : bytes)
+                result = result << 8 | byte;
+            return result;
+        }
+
+        uint64_t bits;
+    };
+};
+
+template <>
+struct KeyPrefix<std::string> : StringKeyPrefix {};
+
+template <>
+struct KeyPrefix<std::string_view> : StringKeyPrefix {};
+
+// Turns prefix into the smallest string greater than all strings
+// starting with it, returns false if there is no such string
+inline bool prefixSuccessor(std::string& prefix) {
+    while (!prefix.empty() && static_cast<unsigned char>(prefix.back()) == 0xff)
+        prefix.pop_back();
+    if (prefix.empty())
+        return false;
+    ++prefix.back();
+    return true;
+}
+
+/*-------------------------------------------------------
+    Subtree hash
+    Nodes keep KeyHash<ValueType>::Sum, the sum of mixed key
+    hashes over their subtree. A sum does not depend on the
+    shape of the tree, so equal sets have equal root sums.
+    Off by default since it adds 16 bytes to every node and
+    a little work to every update, a key type opts in with
+        template <> struct KeyHash<Key> : StdKeyHash<Key> {};
 -------------------------------------------------------*/
 
+struct NoKeyHash {
+    struct Sum {
+        static constexpr bool enabled = false;
+
+        template<typename ValueType>
+        explicit Sum(const ValueType&) {}
+
+        void update(uint64_t, uint64_t) {}
+
+        uint64_t own() const {
+            return 0;
+        }
+
+        uint64_t total() const {
+            return 0;
+        }
+    };
+};
+
+template <typename ValueType>
+struct KeyHash : NoKeyHash {};
+
+// Sums built from std::hash<ValueType>
 template <typename ValueType>
+struct StdKeyHash {
+    struct Sum {
+        static constexpr bool enabled = true;
+
+        explicit Sum(const ValueType& key) : self(mix(std::hash<ValueType>()(key))), sum(self) {}
+
+        void update(uint64_t left, uint64_t right) {
+            sum = left + self + right;
+        }
+
+        uint64_t own() const {
+            return self;
+        }
+
+        uint64_t total() const {
+            return sum;
+        }
+
+        // splitmix64 step, std::hash is the identity for integers
+        // and a plain finalizer would leave 0 at 0
+        static uint64_t mix(uint64_t x) {
+            x += 0x9e3779b97f4a7c15ULL;
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return x ^ (x >> 31);
+        }
+
+        uint64_t self, sum;
+    };
+};
+
+/*-------------------------------------------------------
+    Subtree summary
+    Nodes keep KeySummary<ValueType>::Summary, refolded over
+    their subtree by update(key, left, right) whenever the
+    subtree changes, a missing child passed as nullptr.
+    Set::find_first leaves out subtrees by their summary.
+    Empty by default, a key type opts in by specializing
+    KeySummary, see versioned_set.h
+-------------------------------------------------------*/
+
+struct NoKeySummary {
+    struct Summary {
+        template<typename ValueType>
+        explicit Summary(const ValueType&) {}
+
+        template<typename ValueType>
+        void update(const ValueType&, const Summary*, const Summary*) {}
+    };
+};
+
+template <typename ValueType>
+struct KeySummary : NoKeySummary {};
+
+/*-------------------------------------------------------
+    Change observer
+    Set::observe(observer) reports every insert and erase that
+    changed the set, and every time it was emptied, after the
+    change is made and on the writing thread. A set without
+    an observer pays one null check per change.
+-------------------------------------------------------*/
+
+template <typename ValueType>
+class SetObserver {
+public:
+    virtual ~SetObserver() = default;
+
+    virtual void inserted(const ValueType& key) = 0;
+
+    virtual void erased(const ValueType& key) = 0;
+
+    virtual void cleared() = 0;
+};
+
+/*-------------------------------------------------------
+    Node alignment
+    Set<ValueType, NodeAlignment> places every node on a
+    NodeAlignment boundary (0 keeps the natural alignment).
+    Passing kCacheLineSize gives each node its own cache
+    lines, so concurrent variants that write one node do not
+    invalidate the lines of its neighbours in the same block.
+-------------------------------------------------------*/
+
+// Fixed rather than std::hardware_destructive_interference_size,
+// which may change with compiler flags and so break layouts
+inline constexpr size_t kCacheLineSize = 64;
+
+/*-------------------------------------------------------
+    Node links
+    Set<ValueType, NodeAlignment, Links> takes the type of the
+    child and parent links and the storage nodes live in from
+    Links, so one copy of the AVL code serves every layout.
+    PointerLinks, the default, links by raw pointers into a
+    NodeArena; OffsetLinks in offset_tree.h links by offsets
+    inside a caller-owned region. A storage provides
+        Link& root(), Node* create(args...), destroy(Node*),
+        release() and swap(Storage&)
+-------------------------------------------------------*/
+
+// Nodes are carved out of blocks owned by the set. Erased nodes go
+// to a free list and are reused by later inserts, so the whole tree
+// can be dropped at once by releasing the blocks.
+// Block capacity doubles up to kMaxBlockNodes
+template <typename Node, size_t NodeAlignment>
+class NodeArena {
+public:
+    NodeArena() = default;
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    ~NodeArena() {
+        release();
+    }
+
+    Node*& root() {
+        return top;
+    }
+
+    Node* const& root() const {
+        return top;
+    }
+
+    template<typename... Args>
+    Node* create(Args&&... args) {
+        void* place = allocate();
+        try {
+            return new (place) Node(std::forward<Args>(args)...);
+        } catch (...) {
+            deallocate(place);
+            throw;
+        }
+    }
+
+    void swap(NodeArena& other) noexcept {
+        std::swap(top, other.top);
+        std::swap(blocks, other.blocks);
+        std::swap(freeList, other.freeList);
+        std::swap(used, other.used);
+        std::swap(capacity, other.capacity);
+    }
+
+    void destroy(Node* t) {
+        t->~Node();
+        deallocate(t);
+    }
+
+    // Forgets the tree and frees every block without running destructors
+    void release() {
+        while (blocks) {
+            Block* next = blocks->next;
+            ::operator delete(blocks, std::align_val_t(alignof(Block)));
+            blocks = next;
+        }
+        top = nullptr;
+        freeList = nullptr;
+        used = capacity = 0;
+    }
+
+private:
+    static constexpr size_t kMinBlockNodes = 16;
+    static constexpr size_t kMaxBlockNodes = 4096;
+
+    static constexpr size_t kSlotAlignment = std::max(NodeAlignment, alignof(Node));
+    static_assert((kSlotAlignment & (kSlotAlignment - 1)) == 0, "NodeAlignment must be a power of two");
+
+    union alignas(kSlotAlignment) Slot {
+        Slot* next;
+        alignas(Node) unsigned char storage[sizeof(Node)];
+    };
+
+    struct alignas(Slot) Block {
+        Block* next;
+        size_t capacity;
+
+        Slot* slots() {
+            return reinterpret_cast<Slot*>(this + 1);
+        }
+    };
+
+    void* allocate() {
+        if (freeList) {
+            Slot* slot = freeList;
+            freeList = slot->next;
+            return slot;
+        }
+        if (used == capacity) {
+            size_t nodes = blocks ? std::min(capacity * 2, kMaxBlockNodes) : kMinBlockNodes;
+            Block* block = static_cast<Block*>(::operator new(sizeof(Block) + nodes * sizeof(Slot),
+                                                              std::align_val_t(alignof(Block))));
+            block->next = blocks;
+            block->capacity = nodes;
+            blocks = block;
+            used = 0;
+            capacity = nodes;
+        }
+        return blocks->slots() + used++;
+    }
+
+    void deallocate(void* place) {
+        Slot* slot = static_cast<Slot*>(place);
+        slot->next = freeList;
+        freeList = slot;
+    }
+
+    Node* top = nullptr;
+    Block* blocks = nullptr;
+    Slot* freeList = nullptr;
+    size_t used = 0, capacity = 0;
+};
+
+struct PointerLinks {
+    template <typename Node>
+    using Link = Node*;
+
+    template <typename Node, size_t NodeAlignment>
+    using Storage = NodeArena<Node, NodeAlignment>;
+};
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+template <typename ValueType, size_t NodeAlignment = 0, typename Links = PointerLinks>
 class Set {
 private:
     struct TreeNode;
+    using Link = typename Links::template Link<TreeNode>;
+
+    // Routes lookups through copies of the top levels, see routed_set.h
+    template <typename, size_t> friend class RoutedSet;
+    // Keeps the tree in a relocatable region, see offset_tree.h
+    template <typename> friend class OffsetTree;
 
 public:
-    using TreeNodeRef = TreeNode*&;
+    using TreeNodeRef = Link&;
 
     //---------------------------------------------------
     // constructors & operator= & destructor
@@ -30,9 +358,11 @@ public:
     template<typename iteratorType>
     Set(iteratorType first, iteratorType last);
     Set(std::initializer_list<ValueType> init);
-    Set(const Set<ValueType>& other);
+    Set(const Set<ValueType, NodeAlignment, Links>& other);
+    Set(Set<ValueType, NodeAlignment, Links>&& other) noexcept;
 
     Set& operator=(const Set& other);
+    Set& operator=(Set&& other) noexcept;
 
     ~Set();
 
@@ -43,6 +373,16 @@ public:
 
     bool empty() const;
 
+    void clear();
+
+    // Empties the set at once but frees at most node_budget nodes per call,
+    // returns true when nothing is left to free. While a clear is being
+    // drained, further calls only free detached nodes, so keys inserted
+    // between calls are kept
+    bool clear_incremental(size_t node_budget);
+
+    void swap(Set& other) noexcept;
+
     void insert(const ValueType& value);
 
     void erase(const ValueType& value);
@@ -53,7 +393,7 @@ public:
     class iterator {
     public:
         iterator() = default;
-        iterator(TreeNode* node, const Set<ValueType>* parent);
+        iterator(TreeNode* node, const Set<ValueType, NodeAlignment, Links>* parent);
 
         iterator& operator++();      // ++it
         iterator operator++(int);    // it++
@@ -69,7 +409,7 @@ public:
 
     private:
         TreeNode* node = nullptr;
-        const Set<ValueType>* parent = nullptr;
+        const Set<ValueType, NodeAlignment, Links>* parent = nullptr;
     };
 
     iterator begin() const;
@@ -83,19 +423,106 @@ public:
 
     iterator lower_bound(const ValueType& key) const;
 
+    // Least key (not less than key) that passes match, subtrees whose
+    // KeySummary passes skip are not entered. O(log n) plus the nodes
+    // of the subtrees skip lets through
+    template<typename Skip, typename Match>
+    iterator find_first(Skip skip, Match match) const;
+
+    template<typename Skip, typename Match>
+    iterator find_first(const ValueType& key, Skip skip, Match match) const;
+
+    // For string keys: the keys starting with prefix, in O(log n)
+    std::pair<iterator, iterator> prefix_range(std::string_view prefix) const;
+
+    size_t count_prefix(std::string_view prefix) const;
+
+    // parts consecutive ranges covering the set whose sizes differ by at
+    // most one, found by rank in O(parts log n)
+    std::vector<std::pair<iterator, iterator>> chunks(size_t parts) const;
+
+    //---------------------------------------------------
+    // Comparison, hash() and hash_diff() need KeyHash<ValueType> enabled
+
+    // Equal sets have equal hashes whatever their shape, O(1)
+    uint64_t hash() const;
+
+    // Sets with different sizes, or different hashes when KeyHash is
+    // enabled, are told apart in O(1). Equal sets are always walked, O(n)
+    bool operator==(const Set<ValueType, NodeAlignment, Links>& other) const;
+    bool operator!=(const Set<ValueType, NodeAlignment, Links>& other) const;
+
+    // Calls onlyHere(key) for keys missing from other and onlyThere(key)
+    // for keys missing here, each in ascending order. Subtrees whose range
+    // has the same count and hash in other are skipped, so d differences
+    // cost O(d log^2 n)
+    template<typename OnlyHere, typename OnlyThere>
+    void hash_diff(const Set<ValueType, NodeAlignment, Links>& other, OnlyHere onlyHere, OnlyThere onlyThere) const;
+
+    //---------------------------------------------------
+    // Batch updates
+
+    // Buffers inserts and erases until commit(), dropping it discards them.
+    // The set must outlive the transaction
+    class Transaction {
+    public:
+        explicit Transaction(Set<ValueType, NodeAlignment, Links>& set);
+
+        void insert(const ValueType& value);
+
+        void erase(const ValueType& value);
+
+        // Number of buffered operations
+        size_t size() const;
+
+        // Applies the buffered operations in key order, the latest one wins
+        void commit();
+
+        void discard();
+
+    private:
+        Set<ValueType, NodeAlignment, Links>* set = nullptr;
+        std::vector<std::pair<ValueType, bool>> changes;  // (key, insert?)
+    };
+
+    Transaction transaction();
+
+    //---------------------------------------------------
+    // Change notification
+
+    // nullptr stops notifications. The observer stays with this object,
+    // copies and moves start without one. Assignment and swap are
+    // reported as cleared() followed by inserted() for every key
+    void observe(SetObserver<ValueType>* observer);
+
 private:
-    struct TreeNode {
+    using KeyCache = typename KeyPrefix<ValueType>::Cache;
+    using KeySum = typename KeyHash<ValueType>::Sum;
+    using NodeSummary = typename KeySummary<ValueType>::Summary;
+
+    // The cache, the sum and the summary are bases so that empty ones take no space
+    struct TreeNode : KeyCache, KeySum, NodeSummary {
         ValueType key = 0;
         size_t height = 1, cnt = 1;
-        TreeNode* left = nullptr, * right = nullptr, * parent = nullptr;
+        Link left = nullptr, right = nullptr, parent = nullptr;
 
         TreeNode() = default;
-        explicit TreeNode(const ValueType& key, TreeNode* parent = nullptr) : key(key), parent(parent) {}
+        explicit TreeNode(const ValueType& key, TreeNode* parent = nullptr) : KeyCache(key), KeySum(key), NodeSummary(key), key(key), parent(parent) {}
     };
 
+    using NodeStorage = typename Links::template Storage<TreeNode, NodeAlignment>;
+
     //---------------------------------------------------
     // Helper functions
 
+    Link& root() {
+        return nodes.root();
+    }
+
+    const Link& root() const {
+        return nodes.root();
+    }
+
     size_t height(const TreeNode* t) const {
         return t ? t->height : 0;
     }
@@ -104,6 +531,14 @@ private:
         return t ? t->cnt : 0;
     }
 
+    uint64_t hashSum(const TreeNode* t) const {
+        return t ? static_cast<const KeySum&>(*t).total() : 0;
+    }
+
+    const NodeSummary* summary(const TreeNode* t) const {
+        return t ? static_cast<const NodeSummary*>(t) : nullptr;
+    }
+
     int getBalance(const TreeNode* t) const {
         return height(t->right) - height(t->left);
     }
@@ -113,13 +548,21 @@ private:
 
         t->height = std::max(height(t->left), height(t->right)) + 1;
         t->cnt = cnt(t->left) + 1 + cnt(t->right);
+        static_cast<KeySum&>(*t).update(hashSum(t->left), hashSum(t->right));
+        static_cast<NodeSummary&>(*t).update(t->key, summary(t->left), summary(t->right));
         t->parent = nullptr;
         if (t->left) t->left->parent = t;
         if (t->right) t->right->parent = t;
     }
 
-    bool isKeyEqual(const ValueType& a, const ValueType& b) const {
-        return !(a < b) && !(b < a);
+    // Sign of (t->key - key), settled on the cached prefixes when they differ
+    int compareKey(const TreeNode* t, const ValueType& key, const KeyCache& probe) const {
+        int result = static_cast<const KeyCache&>(*t).compare(probe);
+        if (result)
+            return result;
+        if (t->key < key)
+            return -1;
+        return key < t->key ? +1 : 0;
     }
 
     //---------------------------------------------------
@@ -182,7 +625,7 @@ private:
         return t;
     }
 
-    TreeNode* eraseMin(TreeNode* t) {
+    TreeNode* eraseMin(Link t) {
         if (!t->left)
             return t->right;
 
@@ -190,7 +633,7 @@ private:
         return balance(t);
     }
 
-    TreeNode* eraseMax(TreeNode* t) {
+    TreeNode* eraseMax(Link t) {
         if (!t->right)
             return t->left;
 
@@ -214,28 +657,30 @@ private:
         return t->parent;
     }
 
-    void AVLInsert(TreeNodeRef t, const ValueType& key, TreeNode* parent = nullptr) {
+    void AVLInsert(TreeNodeRef t, const ValueType& key, const KeyCache& probe, TreeNode* parent = nullptr) {
         if (!t)
-            t = new TreeNode(key, parent);
+            t = nodes.create(key, parent);
 
-        if (isKeyEqual(t->key, key))
+        int cmp = compareKey(t, key, probe);
+        if (cmp == 0)
             return;
-        if (t->key < key)
-            AVLInsert(t->right, key, t);
+        if (cmp < 0)
+            AVLInsert(t->right, key, probe, t);
         else
-            AVLInsert(t->left, key, t);
+            AVLInsert(t->left, key, probe, t);
         
         balance(t);
     }
 
-    void AVLErase(TreeNodeRef t, const ValueType& key) {
+    void AVLErase(TreeNodeRef t, const ValueType& key, const KeyCache& probe) {
         if (!t)
             return;
 
-        if (isKeyEqual(t->key, key)) {
+        int cmp = compareKey(t, key, probe);
+        if (cmp == 0) {
             TreeNode* l = t->left;
             TreeNode* r = t->right;
-            delete t;
+            nodes.destroy(t);
             
             t = l;
             if (r) {
@@ -243,189 +688,681 @@ private:
                 t->right = eraseMin(r);
                 t->left = l;
             }
-        } else if (t->key < key) {
-            AVLErase(t->right, key);
+        } else if (cmp < 0) {
+            AVLErase(t->right, key, probe);
         } else {
-            AVLErase(t->left, key);
+            AVLErase(t->left, key, probe);
         }
 
         balance(t);
     }
 
-    TreeNode* AVLFind(TreeNode* t, ValueType key) const {
+    TreeNode* AVLFind(TreeNode* t, const ValueType& key, const KeyCache& probe) const {
         if (!t)
             return nullptr;
-        if (isKeyEqual(t->key, key))
+        int cmp = compareKey(t, key, probe);
+        if (cmp == 0)
             return t;
-        if (t->key < key)
-            return AVLFind(t->right, key);
+        if (cmp < 0)
+            return AVLFind(t->right, key, probe);
         else
-            return AVLFind(t->left, key);
+            return AVLFind(t->left, key, probe);
     }
 
-    TreeNode* AVLLowerBound(TreeNode* t, ValueType key) const {
+    TreeNode* AVLLowerBound(TreeNode* t, const ValueType& key, const KeyCache& probe) const {
         if (!t)
             return nullptr;
 
-        if (isKeyEqual(t->key, key))
+        int cmp = compareKey(t, key, probe);
+        if (cmp == 0)
             return t;
 
-        if (key < t->key) {
-            TreeNode* tmp = AVLLowerBound(t->left, key);
+        if (cmp > 0) {
+            TreeNode* tmp = AVLLowerBound(t->left, key, probe);
             return tmp ? tmp : t;
         }
         else {
-            return AVLLowerBound(t->right, key);
+            return AVLLowerBound(t->right, key, probe);
+        }
+    }
+
+    // Leftmost node of t not less than *lo (any for nullptr) whose key passes match
+    template<typename Skip, typename Match>
+    TreeNode* AVLFirst(TreeNode* t, const ValueType* lo, Skip& skip, Match& match) const {
+        if (!t || skip(*summary(t)))
+            return nullptr;
+        if (lo && t->key < *lo)
+            return AVLFirst(t->right, lo, skip, match);
+
+        if (TreeNode* found = AVLFirst(t->left, lo, skip, match))
+            return found;
+        if (match(t->key))
+            return t;
+        return AVLFirst(t->right, nullptr, skip, match);
+    }
+
+    // Number of keys less than key
+    size_t AVLRank(TreeNode* t, const ValueType& key, const KeyCache& probe) const {
+        size_t result = 0;
+        while (t) {
+            if (compareKey(t, key, probe) < 0) {
+                result += cnt(t->left) + 1;
+                t = t->right;
+            } else {
+                t = t->left;
+            }
+        }
+        return result;
+    }
+
+    // k-th smallest key of t counting from 0, nullptr past the end
+    TreeNode* AVLSelect(TreeNode* t, size_t k) const {
+        while (t) {
+            size_t left = cnt(t->left);
+            if (k == left)
+                return t;
+            if (k < left) {
+                t = t->left;
+            } else {
+                k -= left + 1;
+                t = t->right;
+            }
         }
+        return nullptr;
+    }
+
+    // Count and hash sum of the keys less than key, or not greater when inclusive
+    std::pair<size_t, uint64_t> AVLPrefix(TreeNode* t, const ValueType& key, const KeyCache& probe, bool inclusive) const {
+        size_t count = 0;
+        uint64_t sum = 0;
+        while (t) {
+            int cmp = compareKey(t, key, probe);
+            if (cmp < 0 || (cmp == 0 && inclusive)) {
+                count += cnt(t->left) + 1;
+                sum += hashSum(t->left) + static_cast<const KeySum&>(*t).own();
+                t = t->right;
+            } else {
+                t = t->left;
+            }
+        }
+        return {count, sum};
+    }
+
+    // Count and hash sum of the keys strictly between lo and hi, nullptr is unbounded
+    std::pair<size_t, uint64_t> rangeSum(const ValueType* lo, const ValueType* hi) const {
+        std::pair<size_t, uint64_t> upper(cnt(root()), hashSum(root())), lower(0, 0);
+        if (hi)
+            upper = AVLPrefix(root(), *hi, KeyCache(*hi), false);
+        if (lo)
+            lower = AVLPrefix(root(), *lo, KeyCache(*lo), true);
+        return {upper.first - lower.first, upper.second - lower.second};
+    }
+
+    template<typename Function>
+    void forRange(const ValueType* lo, const ValueType* hi, Function& fn) const {
+        iterator it = lo ? lower_bound(*lo) : begin();
+        if (lo && it != end() && !(*lo < *it))
+            ++it;
+        for (; it != end() && (!hi || *it < *hi); ++it)
+            fn(*it);
+    }
+
+    // t holds exactly the keys of this set strictly between lo and hi
+    template<typename OnlyHere, typename OnlyThere>
+    void hashDiff(TreeNode* t, const ValueType* lo, const ValueType* hi, const Set<ValueType, NodeAlignment, Links>& other,
+                  OnlyHere& onlyHere, OnlyThere& onlyThere) const {
+        std::pair<size_t, uint64_t> there = other.rangeSum(lo, hi);
+        if (there.first == cnt(t) && there.second == hashSum(t))
+            return;
+
+        if (!t || !there.first) {
+            if (t)
+                forRange(lo, hi, onlyHere);
+            else
+                other.forRange(lo, hi, onlyThere);
+            return;
+        }
+
+        hashDiff(t->left, lo, &t->key, other, onlyHere, onlyThere);
+        if (!other.AVLFind(other.root(), t->key, KeyCache(t->key)))
+            onlyHere(t->key);
+        hashDiff(t->right, &t->key, hi, other, onlyHere, onlyThere);
+    }
+
+    //---------------------------------------------------
+    // Batch updates
+    /*
+        changes are sorted by key without duplicates. A batch that is
+        small next to the tree goes through AVLInsert/AVLErase, a large
+        one is merged with the in-order node list and the tree is
+        rebuilt perfectly balanced in a single pass.
+    */
+    void applyBatch(const std::vector<std::pair<ValueType, bool>>& changes) {
+        if (changes.size() * height(root()) < size()) {
+            for (const auto& change : changes) {
+                if (change.second)
+                    insert(change.first);
+                else
+                    erase(change.first);
+            }
+            return;
+        }
+
+        std::vector<TreeNode*> current;
+        current.reserve(size());
+        for (TreeNode* t = findMin(root()); t; t = nextNode(t))
+            current.push_back(t);
+
+        std::vector<TreeNode*> merged;
+        merged.reserve(current.size() + changes.size());
+        std::vector<const std::pair<ValueType, bool>*> applied;  // reported once the tree is rebuilt
+        auto it = current.begin();
+        for (const auto& change : changes) {
+            const ValueType& key = change.first;
+            for (; it != current.end() && (*it)->key < key; ++it)
+                merged.push_back(*it);
+
+            bool present = it != current.end() && !(key < (*it)->key);
+            if (present && !change.second) {
+                nodes.destroy(*it++);
+                if (observer)
+                    applied.push_back(&change);
+            } else if (present) {
+                merged.push_back(*it++);
+            } else if (change.second) {
+                merged.push_back(nodes.create(key));
+                if (observer)
+                    applied.push_back(&change);
+            }
+        }
+        merged.insert(merged.end(), it, current.end());
+
+        root() = buildTree(merged.data(), merged.size());
+        for (const auto* change : applied) {
+            if (change->second)
+                observer->inserted(change->first);
+            else
+                observer->erased(change->first);
+        }
+    }
+
+    // Links sorted items into a perfectly balanced tree
+    TreeNode* buildTree(TreeNode** items, size_t count) const {
+        if (!count)
+            return nullptr;
+
+        size_t mid = count / 2;
+        TreeNode* t = items[mid];
+        t->left = buildTree(items, mid);
+        t->right = buildTree(items + mid + 1, count - mid - 1);
+        update(t);
+        return t;
+    }
+
+    // Tells the observer the whole contents changed
+    void notifyReset() {
+        if (!observer)
+            return;
+        observer->cleared();
+        for (TreeNode* t = findMin(root()); t; t = nextNode(t))
+            observer->inserted(t->key);
+    }
+
+    // Frees everything without telling the observer
+    void release() {
+        if (!std::is_trivially_destructible<ValueType>::value) {
+            destroyKeys(root());
+            destroyKeys(graveyard);
+        }
+        graveyard = nullptr;
+        nodes.release();
     }
 
     void copyTree(TreeNode* from, TreeNodeRef to) {
         if (!from)
             return void(to = nullptr);
 
-        to = new TreeNode(*from);
+        to = nodes.create(*from);
         copyTree(from->left, to->left);
         copyTree(from->right, to->right);
         return update(to);
     }
 
-    void deleteTree(TreeNodeRef t) {
-        if (!t) return;
-
-        deleteTree(t->left);
-        deleteTree(t->right);
-        delete t;
-        t = nullptr;
+    // Runs key destructors only, the memory is reclaimed by nodes.release().
+    // Right rotations flatten the tree as we go, so it works for any shape
+    static void destroyKeys(TreeNode* t) {
+        while (t) {
+            if (t->left) {
+                TreeNode* l = t->left;
+                t->left = l->right;
+                l->right = t;
+                t = l;
+            } else {
+                TreeNode* next = t->right;
+                t->~TreeNode();
+                t = next;
+            }
+        }
     }
 
     //---------------------------------------------------
 
-    TreeNode* root = nullptr;
+    NodeStorage nodes;
+    TreeNode* graveyard = nullptr;  // detached nodes awaiting clear_incremental
+    SetObserver<ValueType>* observer = nullptr;
 };
 
+/*-------------------------------------------------------
+    Iterator over a set that may change under it
+    Holds a copy of the current key and steps by asking the
+    owner for the next greater one, Owner::upper_bound(key)
+-------------------------------------------------------*/
+
+template <typename Owner, typename ValueType>
+class KeyCursor {
+public:
+    KeyCursor() = default;
+    KeyCursor(const Owner* parent, const ValueType* key) : parent(parent), valid(key != nullptr) {
+        if (key)
+            this->key = *key;
+    }
+
+    KeyCursor& operator++() {      // ++it
+        *this = parent->upper_bound(key);
+        return *this;
+    }
+
+    KeyCursor operator++(int) {    // it++
+        KeyCursor old(*this);
+        ++*this;
+        return old;
+    }
+
+    const ValueType& operator*() const {
+        return key;
+    }
+
+    const ValueType* operator->() const {
+        return &key;
+    }
+
+    bool operator==(const KeyCursor& other) const {
+        if (this->valid != other.valid || this->parent != other.parent)
+            return false;
+        return !valid || (!(key < other.key) && !(other.key < key));
+    }
+
+    bool operator!=(const KeyCursor& other) const {
+        return !(*this == other);
+    }
+
+private:
+    const Owner* parent = nullptr;
+    bool valid = false;
+    ValueType key{};
+};
+
+/*-------------------------------------------------------
+    Set difference
+    diff(a, b, onlyA, onlyB) walks both sets in order once and
+    calls onlyA(key) for keys missing from b, onlyB(key) for
+    keys missing from a. The result is exact, a few changes
+    in a large set are cheaper with Set::hash_diff, which
+    trusts equal subtree hashes
+-------------------------------------------------------*/
+
+template <typename ValueType, size_t NodeAlignment, typename OnlyA, typename OnlyB>
+void diff(const Set<ValueType, NodeAlignment>& a, const Set<ValueType, NodeAlignment>& b, OnlyA onlyA, OnlyB onlyB) {
+    auto ia = a.begin(), ib = b.begin();
+    while (ia != a.end() && ib != b.end()) {
+        if (*ia < *ib) {
+            onlyA(*ia);
+            ++ia;
+        } else if (*ib < *ia) {
+            onlyB(*ib);
+            ++ib;
+        } else {
+            ++ia;
+            ++ib;
+        }
+    }
+    for (; ia != a.end(); ++ia)
+        onlyA(*ia);
+    for (; ib != b.end(); ++ib)
+        onlyB(*ib);
+}
+
 /*-------------------------------------------------------
     Implementation
 -------------------------------------------------------*/
 
-template<typename ValueType>
+template<typename ValueType, size_t NodeAlignment, typename Links>
 template<typename iteratorType>
-Set<ValueType>::Set(iteratorType first, iteratorType last) {
+Set<ValueType, NodeAlignment, Links>::Set(iteratorType first, iteratorType last) {
     for (; first != last; ++first)
         insert(*first);
 }
 
-template<typename ValueType>
-Set<ValueType>::Set(std::initializer_list<ValueType> init) {
+template<typename ValueType, size_t NodeAlignment, typename Links>
+Set<ValueType, NodeAlignment, Links>::Set(std::initializer_list<ValueType> init) {
     for (const ValueType& value : init)
         insert(value);
 }
 
-template<typename ValueType>
-Set<ValueType>::Set(const Set<ValueType>& other) {
-    copyTree(other.root, root);
+template<typename ValueType, size_t NodeAlignment, typename Links>
+Set<ValueType, NodeAlignment, Links>::Set(const Set<ValueType, NodeAlignment, Links>& other) {
+    copyTree(other.root(), root());
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+Set<ValueType, NodeAlignment, Links>::Set(Set<ValueType, NodeAlignment, Links>&& other) noexcept {
+    swap(other);
 }
 
-template<typename ValueType>
-Set<ValueType>::~Set() {
-    deleteTree(root);
+template<typename ValueType, size_t NodeAlignment, typename Links>
+Set<ValueType, NodeAlignment, Links>::~Set() {
+    release();
 }
 
-template<typename ValueType>
-Set<ValueType>& Set<ValueType>::operator=(const Set<ValueType>& other) {
+template<typename ValueType, size_t NodeAlignment, typename Links>
+Set<ValueType, NodeAlignment, Links>& Set<ValueType, NodeAlignment, Links>::operator=(const Set<ValueType, NodeAlignment, Links>& other) {
     if (this != &other) {
-        deleteTree(root);
-        copyTree(other.root, root);
+        release();
+        copyTree(other.root(), root());
+        notifyReset();
     }
     return *this;
 }
 
-template<typename ValueType>
-size_t Set<ValueType>::size() const {
-    return cnt(root);
+template<typename ValueType, size_t NodeAlignment, typename Links>
+Set<ValueType, NodeAlignment, Links>& Set<ValueType, NodeAlignment, Links>::operator=(Set<ValueType, NodeAlignment, Links>&& other) noexcept {
+    if (this != &other) {
+        release();
+        swap(other);
+    }
+    return *this;
 }
 
-template<typename ValueType>
-bool Set<ValueType>::empty() const {
+template<typename ValueType, size_t NodeAlignment, typename Links>
+size_t Set<ValueType, NodeAlignment, Links>::size() const {
+    return cnt(root());
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+bool Set<ValueType, NodeAlignment, Links>::empty() const {
     return size() == 0;
 }
 
-template<typename ValueType>
-void Set<ValueType>::insert(const ValueType& value) {
-    AVLInsert(root, value);
+template<typename ValueType, size_t NodeAlignment, typename Links>
+void Set<ValueType, NodeAlignment, Links>::clear() {
+    bool changed = root() != nullptr;
+    release();
+    if (observer && changed)
+        observer->cleared();
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+bool Set<ValueType, NodeAlignment, Links>::clear_incremental(size_t node_budget) {
+    if (!graveyard && root()) {
+        findMax(root())->right = graveyard;
+        graveyard = root();
+        root() = nullptr;
+        if (observer)
+            observer->cleared();
+    }
+
+    // Same flattening as destroyKeys, one rotation or one free per unit of budget
+    for (; graveyard && node_budget; --node_budget) {
+        TreeNode* t = graveyard;
+        if (t->left) {
+            graveyard = t->left;
+            t->left = graveyard->right;
+            graveyard->right = t;
+        } else {
+            graveyard = t->right;
+            nodes.destroy(t);
+        }
+    }
+
+    if (graveyard)
+        return false;
+    // Keys inserted since the clear started live in the same arena
+    if (!root())
+        nodes.release();
+    return true;
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+void Set<ValueType, NodeAlignment, Links>::swap(Set<ValueType, NodeAlignment, Links>& other) noexcept {
+    nodes.swap(other.nodes);
+    std::swap(graveyard, other.graveyard);
+    notifyReset();
+    other.notifyReset();
 }
 
-template<typename ValueType>
-void Set<ValueType>::erase(const ValueType& value) {
-    AVLErase(root, value);
+template<typename ValueType, size_t NodeAlignment, typename Links>
+void Set<ValueType, NodeAlignment, Links>::insert(const ValueType& value) {
+    if (!observer)
+        return AVLInsert(root(), value, KeyCache(value));
+
+    size_t before = size();
+    AVLInsert(root(), value, KeyCache(value));
+    if (size() != before)
+        observer->inserted(value);
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+void Set<ValueType, NodeAlignment, Links>::erase(const ValueType& value) {
+    if (!observer)
+        return AVLErase(root(), value, KeyCache(value));
+
+    size_t before = size();
+    AVLErase(root(), value, KeyCache(value));
+    if (size() != before)
+        observer->erased(value);
 }
 
-template<typename ValueType>
-Set<ValueType>::iterator::iterator(TreeNode* node, const Set<ValueType>* parent) : node(node), parent(parent) {}
+template<typename ValueType, size_t NodeAlignment, typename Links>
+Set<ValueType, NodeAlignment, Links>::iterator::iterator(TreeNode* node, const Set<ValueType, NodeAlignment, Links>* parent) : node(node), parent(parent) {}
 
-template<typename ValueType>
-typename Set<ValueType>::iterator& Set<ValueType>::iterator::operator++() {
+template<typename ValueType, size_t NodeAlignment, typename Links>
+typename Set<ValueType, NodeAlignment, Links>::iterator& Set<ValueType, NodeAlignment, Links>::iterator::operator++() {
     node = nextNode(node);
     return *this;
 }
 
-template<typename ValueType>
-typename Set<ValueType>::iterator Set<ValueType>::iterator::operator++(int) {
+template<typename ValueType, size_t NodeAlignment, typename Links>
+typename Set<ValueType, NodeAlignment, Links>::iterator Set<ValueType, NodeAlignment, Links>::iterator::operator++(int) {
     iterator old(*this);
     node = nextNode(node);
     return old;
 }
 
-template<typename ValueType>
-typename Set<ValueType>::iterator& Set<ValueType>::iterator::operator--() {
-    node = node ? prevNode(node) : findMax(parent->root);
+template<typename ValueType, size_t NodeAlignment, typename Links>
+typename Set<ValueType, NodeAlignment, Links>::iterator& Set<ValueType, NodeAlignment, Links>::iterator::operator--() {
+    node = node ? prevNode(node) : findMax(parent->root());
     return *this;
 }
 
-template<typename ValueType>
-typename Set<ValueType>::iterator Set<ValueType>::iterator::operator--(int) {
+template<typename ValueType, size_t NodeAlignment, typename Links>
+typename Set<ValueType, NodeAlignment, Links>::iterator Set<ValueType, NodeAlignment, Links>::iterator::operator--(int) {
     iterator old(*this);
-    node = node ? prevNode(node) : findMax(parent->root);
+    node = node ? prevNode(node) : findMax(parent->root());
     return old;
 }
 
-template<typename ValueType>
-const ValueType& Set<ValueType>::iterator::operator*() const {
+template<typename ValueType, size_t NodeAlignment, typename Links>
+const ValueType& Set<ValueType, NodeAlignment, Links>::iterator::operator*() const {
     return node->key;
 }
 
-template<typename ValueType>
-const ValueType* Set<ValueType>::iterator::operator->() const {
+template<typename ValueType, size_t NodeAlignment, typename Links>
+const ValueType* Set<ValueType, NodeAlignment, Links>::iterator::operator->() const {
     return &(node->key);
 }
 
-template<typename ValueType>
-bool Set<ValueType>::iterator::operator==(const iterator& other) const {
+template<typename ValueType, size_t NodeAlignment, typename Links>
+bool Set<ValueType, NodeAlignment, Links>::iterator::operator==(const iterator& other) const {
     return this->node == other.node && this->parent == other.parent;
 }
 
-template<typename ValueType>
-bool Set<ValueType>::iterator::operator!=(const iterator& other) const {
+template<typename ValueType, size_t NodeAlignment, typename Links>
+bool Set<ValueType, NodeAlignment, Links>::iterator::operator!=(const iterator& other) const {
     return this->node != other.node || this->parent != other.parent;
 }
 
-template<typename ValueType>
-typename Set<ValueType>::iterator Set<ValueType>::begin() const {
-    return iterator(findMin(root), this);
+template<typename ValueType, size_t NodeAlignment, typename Links>
+typename Set<ValueType, NodeAlignment, Links>::iterator Set<ValueType, NodeAlignment, Links>::begin() const {
+    return iterator(findMin(root()), this);
 }
 
-template<typename ValueType>
-typename Set<ValueType>::iterator Set<ValueType>::end() const {
+template<typename ValueType, size_t NodeAlignment, typename Links>
+typename Set<ValueType, NodeAlignment, Links>::iterator Set<ValueType, NodeAlignment, Links>::end() const {
     return iterator(nullptr, this);
 }
 
-template<typename ValueType>
-typename Set<ValueType>::iterator Set<ValueType>::find(const ValueType& key) const {
-    return iterator(AVLFind(root, key), this);
+template<typename ValueType, size_t NodeAlignment, typename Links>
+typename Set<ValueType, NodeAlignment, Links>::iterator Set<ValueType, NodeAlignment, Links>::find(const ValueType& key) const {
+    return iterator(AVLFind(root(), key, KeyCache(key)), this);
 }
 
-template<typename ValueType>
-typename Set<ValueType>::iterator Set<ValueType>::lower_bound(const ValueType& key) const {
-    return iterator(AVLLowerBound(root, key), this);
+template<typename ValueType, size_t NodeAlignment, typename Links>
+typename Set<ValueType, NodeAlignment, Links>::iterator Set<ValueType, NodeAlignment, Links>::lower_bound(const ValueType& key) const {
+    return iterator(AVLLowerBound(root(), key, KeyCache(key)), this);
 }
 
 
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+template<typename Skip, typename Match>
+typename Set<ValueType, NodeAlignment, Links>::iterator Set<ValueType, NodeAlignment, Links>::find_first(Skip skip, Match match) const {
+    return iterator(AVLFirst(root(), nullptr, skip, match), this);
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+template<typename Skip, typename Match>
+typename Set<ValueType, NodeAlignment, Links>::iterator Set<ValueType, NodeAlignment, Links>::find_first(const ValueType& key, Skip skip, Match match) const {
+    return iterator(AVLFirst(root(), &key, skip, match), this);
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+std::pair<typename Set<ValueType, NodeAlignment, Links>::iterator, typename Set<ValueType, NodeAlignment, Links>::iterator>
+Set<ValueType, NodeAlignment, Links>::prefix_range(std::string_view prefix) const {
+    std::string upper(prefix);
+    if (!prefixSuccessor(upper))
+        return {lower_bound(ValueType(prefix)), end()};
+    return {lower_bound(ValueType(prefix)), lower_bound(ValueType(upper))};
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+size_t Set<ValueType, NodeAlignment, Links>::count_prefix(std::string_view prefix) const {
+    ValueType lower(prefix);
+    size_t below = AVLRank(root(), lower, KeyCache(lower));
+
+    std::string upper(prefix);
+    if (!prefixSuccessor(upper))
+        return size() - below;
+    ValueType key(upper);
+    return AVLRank(root(), key, KeyCache(key)) - below;
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+std::vector<std::pair<typename Set<ValueType, NodeAlignment, Links>::iterator, typename Set<ValueType, NodeAlignment, Links>::iterator>>
+Set<ValueType, NodeAlignment, Links>::chunks(size_t parts) const {
+    std::vector<std::pair<iterator, iterator>> result;
+    result.reserve(parts);
+
+    size_t total = size(), start = 0;
+    iterator first = begin();
+    for (size_t i = 0; i < parts; ++i) {
+        size_t end = start + total / parts + (i < total % parts);
+        iterator last(AVLSelect(root(), end), this);
+        result.emplace_back(first, last);
+        first = last;
+        start = end;
+    }
+    return result;
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+uint64_t Set<ValueType, NodeAlignment, Links>::hash() const {
+    static_assert(KeySum::enabled, "hash() needs KeyHash<ValueType>");
+    return hashSum(root());
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+bool Set<ValueType, NodeAlignment, Links>::operator==(const Set<ValueType, NodeAlignment, Links>& other) const {
+    if (size() != other.size() || hashSum(root()) != hashSum(other.root()))
+        return false;
+    for (iterator a = begin(), b = other.begin(); a != end(); ++a, ++b)
+        if (*a < *b || *b < *a)
+            return false;
+    return true;
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+bool Set<ValueType, NodeAlignment, Links>::operator!=(const Set<ValueType, NodeAlignment, Links>& other) const {
+    return !(*this == other);
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+template<typename OnlyHere, typename OnlyThere>
+void Set<ValueType, NodeAlignment, Links>::hash_diff(const Set<ValueType, NodeAlignment, Links>& other,
+                                              OnlyHere onlyHere, OnlyThere onlyThere) const {
+    static_assert(KeySum::enabled, "hash_diff() needs KeyHash<ValueType>");
+    hashDiff(root(), nullptr, nullptr, other, onlyHere, onlyThere);
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+Set<ValueType, NodeAlignment, Links>::Transaction::Transaction(Set<ValueType, NodeAlignment, Links>& set) : set(&set) {}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+void Set<ValueType, NodeAlignment, Links>::Transaction::insert(const ValueType& value) {
+    changes.emplace_back(value, true);
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+void Set<ValueType, NodeAlignment, Links>::Transaction::erase(const ValueType& value) {
+    changes.emplace_back(value, false);
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+size_t Set<ValueType, NodeAlignment, Links>::Transaction::size() const {
+    return changes.size();
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+void Set<ValueType, NodeAlignment, Links>::Transaction::commit() {
+    std::stable_sort(changes.begin(), changes.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+
+    // Keep only the last change of every key
+    size_t kept = 0;
+    for (size_t i = 0; i < changes.size(); ++i) {
+        if (i + 1 < changes.size() && !(changes[i].first < changes[i + 1].first))
+            continue;
+        if (kept != i)
+            changes[kept] = std::move(changes[i]);
+        ++kept;
+    }
+    changes.resize(kept);
+
+    set->applyBatch(changes);
+    changes.clear();
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+void Set<ValueType, NodeAlignment, Links>::Transaction::discard() {
+    changes.clear();
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+typename Set<ValueType, NodeAlignment, Links>::Transaction Set<ValueType, NodeAlignment, Links>::transaction() {
+    return Transaction(*this);
+}
+
+template<typename ValueType, size_t NodeAlignment, typename Links>
+void Set<ValueType, NodeAlignment, Links>::observe(SetObserver<ValueType>* observer) {
+    this->observer = observer;
+}
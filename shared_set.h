@@ -0,0 +1,330 @@
+/*-------------------------------------------------------
+
+    AVL set living in a shared memory segment
+    The segment holds an OffsetTree, so every process may map
+    it at its own address. A robust process-shared mutex right
+    after the tree header serializes writers from different
+    processes: a process dying while it holds the lock does
+    not block the others, and if it died in the middle of a
+    write the segment is marked broken and every later call
+    throws. Readers do not lock, they retry when the write
+    sequence next to the mutex moved under them (a seqlock).
+    Keys must be trivially copyable
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "offset_tree.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+template <typename ValueType>
+class SharedSet {
+public:
+    //---------------------------------------------------
+    // constructors & destructor
+
+    // Creates the POSIX shared memory object name with room for capacity keys
+    SharedSet(const std::string& name, size_t capacity);
+    // Attaches to an existing one
+    explicit SharedSet(const std::string& name);
+
+    SharedSet(const SharedSet&) = delete;
+    SharedSet& operator=(const SharedSet&) = delete;
+
+    // Unmaps the segment, it outlives the process until unlink()
+    ~SharedSet();
+
+    static void unlink(const std::string& name);
+
+    //---------------------------------------------------
+    // Methods, writers take the segment lock and readers wait for
+    // it only while writers keep getting in their way. All of them
+    // throw std::runtime_error once the segment is broken
+
+    size_t size() const;
+
+    bool empty() const;
+
+    size_t capacity() const;
+
+    // Throws std::length_error when the segment is full
+    void insert(const ValueType& value);
+
+    void erase(const ValueType& value);
+
+    void clear();
+
+    //---------------------------------------------------
+    // iterators
+
+    // Stays valid across writers, see KeyCursor
+    using iterator = KeyCursor<SharedSet<ValueType>, ValueType>;
+
+    iterator begin() const;
+
+    iterator end() const;
+
+    //---------------------------------------------------
+    // Search methods
+
+    iterator find(const ValueType& key) const;
+
+    iterator lower_bound(const ValueType& key) const;
+
+    iterator upper_bound(const ValueType& key) const;
+
+    bool contains(const ValueType& key) const;
+
+private:
+    // Lives in the segment
+    struct SegmentLock {
+        pthread_mutex_t mutex;
+        uint32_t writing;   // set while a writer may have the tree half updated
+        uint32_t broken;    // a writer died with writing set
+        uint64_t sequence;  // odd while a writer is in, a dead writer leaves it odd
+    };
+
+    // Holds the segment lock for one call, a writer also keeps the
+    // sequence odd meanwhile
+    class Guard {
+    public:
+        Guard(const SharedSet<ValueType>* parent, bool write);
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        ~Guard();
+
+    private:
+        SegmentLock* state;
+        bool write;
+    };
+
+    static constexpr int kOptimisticTries = 4;
+
+    using Tree = OffsetTree<ValueType>;
+
+    static void check(bool ok, const char* what) {
+        if (!ok)
+            throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    void map(int fd, size_t length) {
+        void* place = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        check(place != MAP_FAILED, "mmap");
+        tree.rebase(static_cast<char*>(place));
+        mapped = length;
+    }
+
+    SegmentLock* segmentLock() const {
+        return reinterpret_cast<SegmentLock*>(tree.data() + sizeof(typename Tree::Header));
+    }
+
+    // Runs read(torn) without the lock and keeps the result if no writer
+    // came by meanwhile. A writer inside, or one that moved the sequence
+    // kOptimisticTries times, sends the reader through the Guard, which
+    // waits for a live writer and throws on a dead one
+    template<typename Read>
+    auto optimistic(Read read) const {
+        SegmentLock* state = segmentLock();
+        for (int tries = 0; tries < kOptimisticTries; ++tries) {
+            uint64_t before = __atomic_load_n(&state->sequence, __ATOMIC_ACQUIRE);
+            if (before & 1)
+                break;
+            bool torn = false;
+            auto result = read(torn);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (!torn && __atomic_load_n(&state->sequence, __ATOMIC_RELAXED) == before)
+                return result;
+        }
+
+        Guard guard(this, false);
+        bool torn = false;
+        return read(torn);
+    }
+
+    // Cursor at the least key >= *key, > *key when strict, the smallest for nullptr
+    iterator seek(const ValueType* key, bool strict) const {
+        ValueType found;
+        bool exists = optimistic([&](bool& torn) {
+            return tree.racyLowerBound(key, strict, found, torn);
+        });
+        return iterator(this, exists ? &found : nullptr);
+    }
+
+    //---------------------------------------------------
+
+    Tree tree;
+    size_t mapped = 0;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType>
+SharedSet<ValueType>::SharedSet(const std::string& name, size_t capacity) {
+    size_t length = Tree::regionSize(sizeof(SegmentLock), capacity);
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    check(fd >= 0, "shm_open");
+    if (::ftruncate(fd, off_t(length)) != 0) {
+        ::close(fd);
+        ::shm_unlink(name.c_str());
+        check(false, "ftruncate");
+    }
+    map(fd, length);
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&segmentLock()->mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    segmentLock()->writing = segmentLock()->broken = 0;
+    segmentLock()->sequence = 0;
+    Tree::format(tree.data(), sizeof(SegmentLock), capacity);
+}
+
+template<typename ValueType>
+SharedSet<ValueType>::SharedSet(const std::string& name) {
+    int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+    check(fd >= 0, "shm_open");
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        check(false, "fstat");
+    }
+    map(fd, size_t(info.st_size));
+
+    if (!Tree::valid(tree.data(), mapped) || tree.header()->nodes < sizeof(typename Tree::Header) + sizeof(SegmentLock)) {
+        ::munmap(tree.data(), mapped);
+        throw std::runtime_error("SharedSet: " + name + " is not a set of this key type");
+    }
+}
+
+template<typename ValueType>
+SharedSet<ValueType>::~SharedSet() {
+    ::munmap(tree.data(), mapped);
+}
+
+template<typename ValueType>
+void SharedSet<ValueType>::unlink(const std::string& name) {
+    ::shm_unlink(name.c_str());
+}
+
+// A dead reader only leaves the lock behind, a dead writer may have
+// left a rotation half done, so the segment is given up
+template<typename ValueType>
+SharedSet<ValueType>::Guard::Guard(const SharedSet<ValueType>* parent, bool write)
+    : state(parent->segmentLock()), write(write) {
+    int result = pthread_mutex_lock(&state->mutex);
+    if (result == EOWNERDEAD) {
+        if (state->writing)
+            state->broken = 1;
+        state->writing = 0;
+        pthread_mutex_consistent(&state->mutex);
+    } else if (result != 0) {
+        throw std::system_error(result, std::generic_category(), "pthread_mutex_lock");
+    }
+
+    if (state->broken) {
+        pthread_mutex_unlock(&state->mutex);
+        throw std::runtime_error("SharedSet: a process died while writing, the segment is broken");
+    }
+    state->writing = write;
+    if (write) {
+        __atomic_store_n(&state->sequence, state->sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+template<typename ValueType>
+SharedSet<ValueType>::Guard::~Guard() {
+    if (write)
+        __atomic_store_n(&state->sequence, state->sequence + 1, __ATOMIC_RELEASE);
+    state->writing = 0;
+    pthread_mutex_unlock(&state->mutex);
+}
+
+template<typename ValueType>
+size_t SharedSet<ValueType>::size() const {
+    return optimistic([this](bool& torn) {
+        return tree.racySize(torn);
+    });
+}
+
+template<typename ValueType>
+bool SharedSet<ValueType>::empty() const {
+    return size() == 0;
+}
+
+template<typename ValueType>
+size_t SharedSet<ValueType>::capacity() const {
+    return tree.header()->capacity;
+}
+
+template<typename ValueType>
+void SharedSet<ValueType>::insert(const ValueType& value) {
+    Guard guard(this, true);
+    tree.insert(value);
+}
+
+template<typename ValueType>
+void SharedSet<ValueType>::erase(const ValueType& value) {
+    Guard guard(this, true);
+    tree.erase(value);
+}
+
+template<typename ValueType>
+void SharedSet<ValueType>::clear() {
+    Guard guard(this, true);
+    tree.clear();
+}
+
+template<typename ValueType>
+typename SharedSet<ValueType>::iterator SharedSet<ValueType>::begin() const {
+    return seek(nullptr, false);
+}
+
+template<typename ValueType>
+typename SharedSet<ValueType>::iterator SharedSet<ValueType>::end() const {
+    return iterator(this, nullptr);
+}
+
+template<typename ValueType>
+typename SharedSet<ValueType>::iterator SharedSet<ValueType>::find(const ValueType& key) const {
+    iterator it = lower_bound(key);
+    return it != end() && !(key < *it) ? it : end();
+}
+
+template<typename ValueType>
+typename SharedSet<ValueType>::iterator SharedSet<ValueType>::lower_bound(const ValueType& key) const {
+    return seek(&key, false);
+}
+
+template<typename ValueType>
+typename SharedSet<ValueType>::iterator SharedSet<ValueType>::upper_bound(const ValueType& key) const {
+    return seek(&key, true);
+}
+
+template<typename ValueType>
+bool SharedSet<ValueType>::contains(const ValueType& key) const {
+    return find(key) != end();
+}
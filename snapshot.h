@@ -0,0 +1,573 @@
+/*-------------------------------------------------------
+
+    Snapshots of a Set and the asynchronous writer behind them
+    AsyncFileWriter queues buffers and returns at once, the
+    bytes are written by io_uring when the kernel allows it
+    and by a background thread doing pwrite otherwise
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*-------------------------------------------------------
+    io_uring
+    Bare bones ring for sequential writes, set up through
+    raw syscalls so that liburing is not required
+-------------------------------------------------------*/
+
+class WriteRing {
+public:
+    static constexpr unsigned kEntries = 64;
+
+    WriteRing() = default;
+    WriteRing(const WriteRing&) = delete;
+    WriteRing& operator=(const WriteRing&) = delete;
+
+    ~WriteRing() {
+        if (sqes)
+            ::munmap(sqes, sqesLength);
+        if (cqRing && cqRing != sqRing)
+            ::munmap(cqRing, cqLength);
+        if (sqRing)
+            ::munmap(sqRing, sqLength);
+        if (ringFd >= 0)
+            ::close(ringFd);
+    }
+
+    // False when io_uring is missing, forbidden or too old for IORING_OP_WRITE
+    bool setup() {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ringFd = int(::syscall(__NR_io_uring_setup, kEntries, &params));
+        if (ringFd < 0 || !supportsWrite())
+            return false;
+
+        sqLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqLength = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sqLength = cqLength = std::max(sqLength, cqLength);
+
+        sqRing = map(sqLength, IORING_OFF_SQ_RING);
+        cqRing = single ? sqRing : map(cqLength, IORING_OFF_CQ_RING);
+        sqesLength = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(map(sqesLength, IORING_OFF_SQES));
+        if (!sqRing || !cqRing || !sqes)
+            return false;
+
+        char* sq = static_cast<char*>(sqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqEntries = params.sq_entries;
+
+        char* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // At most capacity() writes may be in flight
+    unsigned capacity() const {
+        return sqEntries;
+    }
+
+    bool submitWrite(int fd, const char* data, size_t length, uint64_t offset, uint64_t tag) {
+        unsigned tail = *sqTail;
+        unsigned index = tail & sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = unsigned(length);
+        sqe->off = offset;
+        sqe->user_data = tag;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        return enter(1, 0, 0) >= 0;
+    }
+
+    // Calls done(tag, result) for every completion, waiting for at least one if asked
+    template<typename Callback>
+    void reap(bool wait, Callback done) {
+        if (wait && enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cqes[head & cqMask];
+            done(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+private:
+    // Linux 5.1 to 5.5 set up a ring but fail every IORING_OP_WRITE with
+    // -EINVAL. They lack IORING_REGISTER_PROBE as well, which came with it
+    bool supportsWrite() {
+        constexpr unsigned count = IORING_OP_WRITE + 1;
+        alignas(io_uring_probe) unsigned char bytes[sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op)] = {};
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(bytes);
+        if (::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, count) < 0)
+            return false;
+        return probe->ops_len > IORING_OP_WRITE && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    void* map(size_t length, off_t offset) {
+        void* place = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, offset);
+        return place == MAP_FAILED ? nullptr : place;
+    }
+
+    int enter(unsigned submit, unsigned complete, unsigned flags) {
+        return int(::syscall(__NR_io_uring_enter, ringFd, submit, complete, flags, nullptr, 0));
+    }
+
+    //---------------------------------------------------
+
+    int ringFd = -1;
+    void* sqRing = nullptr, * cqRing = nullptr;
+    size_t sqLength = 0, cqLength = 0, sqesLength = 0;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned* sqHead = nullptr, * sqTail = nullptr, * sqArray = nullptr;
+    unsigned* cqHead = nullptr, * cqTail = nullptr;
+    unsigned sqMask = 0, cqMask = 0, sqEntries = 0;
+};
+
+/*-------------------------------------------------------
+    Asynchronous file writer
+-------------------------------------------------------*/
+
+class AsyncFileWriter {
+public:
+    // Truncates path, tries io_uring first unless told not to
+    explicit AsyncFileWriter(const std::string& path, bool useIoUring = true);
+
+    AsyncFileWriter(const AsyncFileWriter&) = delete;
+    AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+
+    ~AsyncFileWriter();
+
+    // Appends buffer to the file without waiting for it to be written,
+    // but blocks while kMaxQueued buffers are still in flight
+    void write(std::vector<char> buffer);
+
+    // Blocks until everything queued so far is written and synced,
+    // rethrows the first write error
+    void wait();
+
+    bool uses_io_uring() const;
+
+    // Buffers the pwrite queue holds before write() blocks, the
+    // io_uring mode blocks once its ring of as many entries is full
+    static constexpr size_t kMaxQueued = WriteRing::kEntries;
+
+private:
+    static void check(bool ok, const char* what) {
+        if (!ok)
+            throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    struct Pending {
+        std::vector<char> buffer;
+        uint64_t offset = 0;
+        size_t written = 0;
+        bool done = false;
+    };
+
+    //---------------------------------------------------
+    // io_uring mode, everything happens on the calling thread
+
+    void submit(uint64_t tag) {
+        Pending& pending = inflight[tag - firstTag];
+        const char* data = pending.buffer.data() + pending.written;
+        size_t length = pending.buffer.size() - pending.written;
+        check(ring.submitWrite(fd, data, length, pending.offset + pending.written, tag), "io_uring_enter");
+        ++submitted;
+    }
+
+    void complete(bool wait) {
+        ring.reap(wait, [this](uint64_t tag, int result) {
+            --submitted;
+            Pending& pending = inflight[tag - firstTag];
+            if (result < 0 && result != -EINTR && result != -EAGAIN) {
+                fail(std::error_code(-result, std::generic_category()));
+                pending.done = true;
+                return;
+            }
+            pending.written += std::max(result, 0);
+            if (pending.written < pending.buffer.size())
+                submit(tag);
+            else
+                pending.done = true;
+        });
+
+        while (!inflight.empty() && inflight.front().done) {
+            inflight.pop_front();
+            ++firstTag;
+        }
+    }
+
+    //---------------------------------------------------
+    // pwrite mode, a background thread drains the queue
+
+    void drain() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            changed.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            Pending pending = std::move(queue.front());
+            lock.unlock();
+            while (pending.written < pending.buffer.size()) {
+                ssize_t result = ::pwrite(fd, pending.buffer.data() + pending.written,
+                                          pending.buffer.size() - pending.written, pending.offset + pending.written);
+                if (result < 0 && errno == EINTR)
+                    continue;
+                if (result < 0) {
+                    fail(std::error_code(errno, std::generic_category()));
+                    break;
+                }
+                pending.written += result;
+            }
+            lock.lock();
+            queue.pop_front();
+            changed.notify_all();
+        }
+    }
+
+    void fail(std::error_code code) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (!error)
+            error = code;
+    }
+
+    //---------------------------------------------------
+
+    int fd = -1;
+    uint64_t offset = 0;  // where the next buffer goes
+
+    WriteRing ring;
+    bool ringReady = false;
+    std::deque<Pending> inflight;
+    uint64_t firstTag = 0;
+    unsigned submitted = 0;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Pending> queue;  // front is being written
+    bool stopping = false;
+    std::thread worker;
+
+    std::mutex errorMutex;
+    std::error_code error;
+};
+
+/*-------------------------------------------------------
+    Snapshots
+    A header followed by the raw keys in order, which needs
+    trivially copyable keys
+-------------------------------------------------------*/
+
+struct SnapshotHeader {
+    static constexpr uint64_t kMagic = 0x544f48534c564156;  // "VAVLSHOT"
+
+    uint64_t magic;
+    uint64_t keySize;
+    uint64_t count;
+};
+
+// Serializes set on the calling thread, the writes happen in the background
+template<typename ValueType, size_t NodeAlignment>
+void writeSnapshot(const Set<ValueType, NodeAlignment>& set, AsyncFileWriter& out);
+
+template<typename ValueType, size_t NodeAlignment = 0>
+Set<ValueType, NodeAlignment> readSnapshot(const std::string& path);
+
+/*-------------------------------------------------------
+    Background snapshot
+    Forks and lets the child write the snapshot, the parent
+    may keep mutating the set at once since the child sees
+    a copy-on-write image of the moment of the fork
+-------------------------------------------------------*/
+
+class BackgroundSnapshot {
+public:
+    // The file appears at path only once it is complete
+    template<typename ValueType, size_t NodeAlignment>
+    BackgroundSnapshot(const Set<ValueType, NodeAlignment>& set, const std::string& path);
+
+    BackgroundSnapshot(const BackgroundSnapshot&) = delete;
+    BackgroundSnapshot& operator=(const BackgroundSnapshot&) = delete;
+
+    // Waits for the child
+    ~BackgroundSnapshot();
+
+    // True once the child has exited, never blocks
+    bool done();
+
+    // Blocks until the child exits, throws if it failed
+    void wait();
+
+private:
+    // Runs in the child: no allocation, only plain syscalls
+    template<typename ValueType, size_t NodeAlignment>
+    static bool writeTo(int fd, const Set<ValueType, NodeAlignment>& set) {
+        static constexpr size_t kBufferBytes = 1 << 16;
+        char buffer[kBufferBytes];
+        size_t used = 0;
+
+        auto flush = [fd, &buffer, &used] {
+            for (size_t done = 0; done < used;) {
+                ssize_t written = ::write(fd, buffer + done, used - done);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written < 0)
+                    return false;
+                done += written;
+            }
+            used = 0;
+            return true;
+        };
+        auto append = [&](const void* bytes, size_t length) {
+            if (used + length > kBufferBytes && !flush())
+                return false;
+            std::memcpy(buffer + used, bytes, length);
+            used += length;
+            return true;
+        };
+
+        SnapshotHeader header{SnapshotHeader::kMagic, sizeof(ValueType), set.size()};
+        if (!append(&header, sizeof(header)))
+            return false;
+        for (const ValueType& key : set)
+            if (!append(&key, sizeof(ValueType)))
+                return false;
+        return flush() && ::fsync(fd) == 0;
+    }
+
+    void reap(int options) {
+        int status = 0;
+        pid_t result;
+        do {
+            result = ::waitpid(child, &status, options);
+        } while (result < 0 && errno == EINTR);
+        if (result == 0)
+            return;
+
+        child = -1;
+        failed = result < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+
+    pid_t child = -1;
+    bool failed = false;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+inline AsyncFileWriter::AsyncFileWriter(const std::string& path, bool useIoUring) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    check(fd >= 0, "open");
+
+    ringReady = useIoUring && ring.setup();
+    if (!ringReady)
+        worker = std::thread(&AsyncFileWriter::drain, this);
+}
+
+inline AsyncFileWriter::~AsyncFileWriter() {
+    try {
+        wait();
+    } catch (...) {
+    }
+    if (worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+    ::close(fd);
+}
+
+inline void AsyncFileWriter::write(std::vector<char> buffer) {
+    if (buffer.empty())
+        return;
+
+    Pending pending;
+    pending.offset = offset;
+    offset += buffer.size();
+    pending.buffer = std::move(buffer);
+
+    if (!ringReady) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return queue.size() < kMaxQueued; });
+        queue.push_back(std::move(pending));
+        changed.notify_all();
+        return;
+    }
+
+    complete(false);
+    while (submitted == ring.capacity())
+        complete(true);
+    inflight.push_back(std::move(pending));
+    submit(firstTag + inflight.size() - 1);
+}
+
+inline void AsyncFileWriter::wait() {
+    if (ringReady) {
+        while (!inflight.empty())
+            complete(true);
+    } else {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return queue.empty(); });
+    }
+
+    std::error_code code;
+    {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        code = error;
+    }
+    if (code)
+        throw std::system_error(code, "AsyncFileWriter");
+    check(::fdatasync(fd) == 0, "fdatasync");
+}
+
+inline bool AsyncFileWriter::uses_io_uring() const {
+    return ringReady;
+}
+
+template<typename ValueType, size_t NodeAlignment>
+void writeSnapshot(const Set<ValueType, NodeAlignment>& set, AsyncFileWriter& out) {
+    static_assert(std::is_trivially_copyable<ValueType>::value, "snapshots store raw keys");
+    static constexpr size_t kBufferBytes = 1 << 20;
+
+    SnapshotHeader header{SnapshotHeader::kMagic, sizeof(ValueType), set.size()};
+    std::vector<char> buffer(reinterpret_cast<const char*>(&header),
+                             reinterpret_cast<const char*>(&header) + sizeof(header));
+    buffer.reserve(kBufferBytes);
+    for (const ValueType& key : set) {
+        if (buffer.size() + sizeof(ValueType) > kBufferBytes) {
+            out.write(std::move(buffer));
+            buffer = std::vector<char>();
+            buffer.reserve(kBufferBytes);
+        }
+        const char* bytes = reinterpret_cast<const char*>(&key);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(ValueType));
+    }
+    out.write(std::move(buffer));
+}
+
+template<typename ValueType, size_t NodeAlignment>
+Set<ValueType, NodeAlignment> readSnapshot(const std::string& path) {
+    static_assert(std::is_trivially_copyable<ValueType>::value, "snapshots store raw keys");
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "open");
+
+    auto readAll = [fd](void* place, size_t length) {
+        char* bytes = static_cast<char*>(place);
+        while (length) {
+            ssize_t got = ::read(fd, bytes, length);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return false;
+            bytes += got;
+            length -= got;
+        }
+        return true;
+    };
+
+    SnapshotHeader header;
+    std::vector<ValueType> keys;
+    bool ok = readAll(&header, sizeof(header)) && header.magic == SnapshotHeader::kMagic &&
+              header.keySize == sizeof(ValueType);
+    if (ok) {
+        keys.resize(header.count);
+        ok = readAll(keys.data(), keys.size() * sizeof(ValueType));
+    }
+    ::close(fd);
+    if (!ok)
+        throw std::runtime_error("readSnapshot: " + path + " is not a snapshot of this key type");
+
+    Set<ValueType, NodeAlignment> set;
+    auto tx = set.transaction();
+    for (const ValueType& key : keys)
+        tx.insert(key);
+    tx.commit();
+    return set;
+}
+
+template<typename ValueType, size_t NodeAlignment>
+BackgroundSnapshot::BackgroundSnapshot(const Set<ValueType, NodeAlignment>& set, const std::string& path) {
+    static_assert(std::is_trivially_copyable<ValueType>::value, "snapshots store raw keys");
+
+    // Everything the child needs is prepared before the fork
+    std::string temporary = path + ".tmp";
+    const char* from = temporary.c_str();
+    const char* to = path.c_str();
+
+    child = ::fork();
+    if (child < 0)
+        throw std::system_error(errno, std::generic_category(), "fork");
+    if (child == 0) {
+        int fd = ::open(from, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && writeTo(fd, set);
+        ok = fd >= 0 && ::close(fd) == 0 && ok;
+        ok = ok && ::rename(from, to) == 0;
+        if (!ok)
+            ::unlink(from);
+        ::_exit(ok ? 0 : 1);
+    }
+}
+
+inline BackgroundSnapshot::~BackgroundSnapshot() {
+    if (child > 0)
+        reap(0);
+}
+
+inline bool BackgroundSnapshot::done() {
+    if (child > 0)
+        reap(WNOHANG);
+    return child < 0;
+}
+
+inline void BackgroundSnapshot::wait() {
+    if (child > 0)
+        reap(0);
+    if (failed)
+        throw std::runtime_error("BackgroundSnapshot: the child failed to write the snapshot");
+}
@@ -0,0 +1,212 @@
+/*-------------------------------------------------------
+
+    Set of strings keeping the key bytes in an arena
+    Nodes hold std::string_view into append-only chunks,
+    so inserting a key costs no allocation of its own
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+class StringSet {
+public:
+    using iterator = Set<std::string_view>::iterator;
+
+    //---------------------------------------------------
+    // constructors & operator= & destructor
+
+    StringSet() = default;
+    StringSet(std::initializer_list<std::string_view> init);
+    StringSet(const StringSet& other);
+    // The moved-from set is left empty with no arena
+    StringSet(StringSet&& other) noexcept;
+
+    StringSet& operator=(const StringSet& other);
+    StringSet& operator=(StringSet&& other) noexcept;
+
+    ~StringSet() = default;
+
+    //---------------------------------------------------
+    // Methods
+
+    size_t size() const;
+
+    bool empty() const;
+
+    void clear();
+
+    void insert(std::string_view value);
+
+    // Bytes of erased keys stay in the arena until compact()
+    void erase(std::string_view value);
+
+    // Copies live keys into a fresh arena, dropping erased ones
+    void compact();
+
+    // Arena bytes in use, including those of erased keys
+    size_t arena_bytes() const;
+
+    //---------------------------------------------------
+    // iterators
+
+    iterator begin() const;
+
+    iterator end() const;
+
+    //---------------------------------------------------
+    // Search methods
+
+    iterator find(std::string_view key) const;
+
+    iterator lower_bound(std::string_view key) const;
+
+    std::pair<iterator, iterator> prefix_range(std::string_view prefix) const;
+
+    size_t count_prefix(std::string_view prefix) const;
+
+private:
+    static constexpr size_t kChunkSize = 64 * 1024;
+
+    // Returns a view of the copy, chunks never move once allocated
+    std::string_view store(std::string_view value) {
+        if (value.empty())
+            return std::string_view();
+
+        char* place;
+        if (value.size() > kChunkSize / 4) {
+            // Long keys get a chunk of their own and leave the current one open
+            chunks.emplace_back(new char[value.size()]);
+            place = chunks.back().get();
+        } else {
+            if (chunkLeft < value.size()) {
+                chunks.emplace_back(new char[kChunkSize]);
+                chunk = chunks.back().get();
+                chunkLeft = kChunkSize;
+            }
+            place = chunk;
+            chunk += value.size();
+            chunkLeft -= value.size();
+        }
+
+        std::memcpy(place, value.data(), value.size());
+        usedBytes += value.size();
+        return std::string_view(place, value.size());
+    }
+
+    //---------------------------------------------------
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char* chunk = nullptr;
+    size_t chunkLeft = 0;
+    size_t usedBytes = 0;
+    Set<std::string_view> keys;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+inline StringSet::StringSet(std::initializer_list<std::string_view> init) {
+    for (std::string_view value : init)
+        insert(value);
+}
+
+inline StringSet::StringSet(const StringSet& other) {
+    for (std::string_view value : other)
+        insert(value);
+}
+
+inline StringSet& StringSet::operator=(const StringSet& other) {
+    if (this != &other) {
+        StringSet copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+inline StringSet::StringSet(StringSet&& other) noexcept {
+    *this = std::move(other);
+}
+
+inline StringSet& StringSet::operator=(StringSet&& other) noexcept {
+    if (this != &other) {
+        keys = std::move(other.keys);
+        chunks = std::move(other.chunks);
+        chunk = other.chunk;
+        chunkLeft = other.chunkLeft;
+        usedBytes = other.usedBytes;
+
+        // Otherwise other would keep writing into the chunk it gave away
+        other.chunks.clear();
+        other.chunk = nullptr;
+        other.chunkLeft = other.usedBytes = 0;
+    }
+    return *this;
+}
+
+inline size_t StringSet::size() const {
+    return keys.size();
+}
+
+inline bool StringSet::empty() const {
+    return keys.empty();
+}
+
+inline void StringSet::clear() {
+    keys.clear();
+    chunks.clear();
+    chunk = nullptr;
+    chunkLeft = usedBytes = 0;
+}
+
+inline void StringSet::insert(std::string_view value) {
+    if (keys.find(value) == keys.end())
+        keys.insert(store(value));
+}
+
+inline void StringSet::erase(std::string_view value) {
+    keys.erase(value);
+}
+
+inline void StringSet::compact() {
+    StringSet copy(*this);
+    *this = std::move(copy);
+}
+
+inline size_t StringSet::arena_bytes() const {
+    return usedBytes;
+}
+
+inline StringSet::iterator StringSet::begin() const {
+    return keys.begin();
+}
+
+inline StringSet::iterator StringSet::end() const {
+    return keys.end();
+}
+
+inline StringSet::iterator StringSet::find(std::string_view key) const {
+    return keys.find(key);
+}
+
+inline StringSet::iterator StringSet::lower_bound(std::string_view key) const {
+    return keys.lower_bound(key);
+}
+
+inline std::pair<StringSet::iterator, StringSet::iterator> StringSet::prefix_range(std::string_view prefix) const {
+    return keys.prefix_range(prefix);
+}
+
+inline size_t StringSet::count_prefix(std::string_view prefix) const {
+    return keys.count_prefix(prefix);
+}
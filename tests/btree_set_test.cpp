@@ -0,0 +1,87 @@
+/*-------------------------------------------------------
+
+    BTreeSet against std::set with an 8 page buffer pool,
+    so nearly every step evicts a page. The tree is closed
+    and reopened along the way to check what reaches the file
+
+    g++ -std=c++17 -O1 -I.. btree_set_test.cpp -o btree_set_test
+
+-------------------------------------------------------*/
+
+#include "../btree_set.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+
+#include <unistd.h>
+
+static void expect(bool ok, const char* what, int step) {
+    if (!ok) {
+        std::fprintf(stderr, "step %d: %s\n", step, what);
+        std::exit(1);
+    }
+}
+
+static bool same(const BTreeSet<int>& tree, const std::set<int>& reference) {
+    auto it = tree.begin();
+    for (int key : reference) {
+        if (it == tree.end() || *it != key)
+            return false;
+        ++it;
+    }
+    return it == tree.end();
+}
+
+int main() {
+    const size_t kFrames = 8;
+    std::string path = "/tmp/btree_set_test." + std::to_string(getpid());
+    unlink(path.c_str());
+
+    std::mt19937 rng(1);
+    std::set<int> reference;
+    auto tree = std::make_unique<BTreeSet<int>>(path, kFrames);
+
+    for (int step = 0; step < 200000; ++step) {
+        int key = rng() % 50000;
+        switch (rng() % 4) {
+        case 0:
+        case 1:
+            tree->insert(key);
+            reference.insert(key);
+            break;
+        case 2:
+            tree->erase(key);
+            reference.erase(key);
+            break;
+        default: {
+            auto it = tree->lower_bound(key);
+            auto expected = reference.lower_bound(key);
+            expect((it == tree->end()) == (expected == reference.end()), "lower_bound end", step);
+            expect(expected == reference.end() || *it == *expected, "lower_bound key", step);
+            expect(tree->contains(key) == (reference.count(key) > 0), "contains", step);
+        }
+        }
+        expect(tree->size() == reference.size(), "size", step);
+
+        if (step % 20000 == 0)
+            expect(same(*tree, reference), "iteration", step);
+        if (step % 50000 == 49999) {
+            tree.reset();
+            tree = std::make_unique<BTreeSet<int>>(path, kFrames);
+            expect(tree->size() == reference.size() && same(*tree, reference), "reopen", step);
+        }
+    }
+
+    tree.reset();
+    tree = std::make_unique<BTreeSet<int>>(path, kFrames);
+    expect(same(*tree, reference), "final reopen", 0);
+    expect(tree->page_misses() > 0, "page_misses", 0);
+
+    tree.reset();
+    unlink(path.c_str());
+    std::puts("btree_set_test: ok");
+}
@@ -0,0 +1,514 @@
+/*-------------------------------------------------------
+
+    Set keeping hot keys in memory and cold ranges on disk
+    spill(lo, hi) moves the in-memory keys of [lo, hi) into a
+    sorted run file, which is read back with pread through a
+    small page cache. Only the first key of every page stays
+    in memory. Runs are merged by size tier, and a merge
+    drops the keys erased since they were spilled together
+    with their tombstones. Keys must be trivially copyable
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*-------------------------------------------------------
+    Sorted run file
+-------------------------------------------------------*/
+
+template <typename ValueType>
+class SortedRun {
+    static_assert(std::is_trivially_copyable<ValueType>::value, "run files store raw keys");
+
+public:
+    static constexpr size_t kPageBytes = 4096;
+    static constexpr size_t kPageKeys = std::max<size_t>(1, kPageBytes / sizeof(ValueType));
+    static constexpr size_t kCachePages = 8;
+
+    // Writes the sorted range to path, the file is removed with the run
+    template<typename iteratorType>
+    SortedRun(const std::string& path, iteratorType first, iteratorType last);
+
+    SortedRun(const SortedRun&) = delete;
+    SortedRun& operator=(const SortedRun&) = delete;
+
+    ~SortedRun();
+
+    size_t size() const;
+
+    ValueType at(size_t index) const;
+
+    // Index of the first key not less than key
+    size_t lower_bound(const ValueType& key) const;
+
+    bool contains(const ValueType& key) const;
+
+    const ValueType& front() const;
+
+    const ValueType& back() const;
+
+private:
+    struct Page {
+        size_t number = SIZE_MAX;
+        size_t lastUse = 0;
+        std::vector<ValueType> keys;
+    };
+
+    static void check(bool ok, const char* what) {
+        if (!ok)
+            throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    void writePage(size_t number, const ValueType* keys, size_t count) {
+        const char* bytes = reinterpret_cast<const char*>(keys);
+        size_t length = count * sizeof(ValueType);
+        off_t offset = off_t(number) * kPageKeys * sizeof(ValueType);
+        while (length) {
+            ssize_t written = ::pwrite(fd, bytes, length, offset);
+            check(written >= 0 || errno == EINTR, "pwrite");
+            if (written <= 0)
+                continue;
+            bytes += written;
+            length -= written;
+            offset += written;
+        }
+    }
+
+    // Least recently used page is replaced on a miss
+    const Page& page(size_t number) const {
+        Page* victim = &cache[0];
+        for (Page& cached : cache) {
+            if (cached.number == number) {
+                cached.lastUse = ++clock;
+                return cached;
+            }
+            if (cached.lastUse < victim->lastUse)
+                victim = &cached;
+        }
+
+        size_t count = std::min(kPageKeys, keyCount - number * kPageKeys);
+        victim->keys.resize(count);
+        char* bytes = reinterpret_cast<char*>(victim->keys.data());
+        size_t length = count * sizeof(ValueType);
+        off_t offset = off_t(number) * kPageKeys * sizeof(ValueType);
+        while (length) {
+            ssize_t got = ::pread(fd, bytes, length, offset);
+            check(got > 0 || (got < 0 && errno == EINTR), "pread");
+            if (got <= 0)
+                continue;
+            bytes += got;
+            length -= got;
+            offset += got;
+        }
+        victim->number = number;
+        victim->lastUse = ++clock;
+        return *victim;
+    }
+
+    //---------------------------------------------------
+
+    std::string path;
+    int fd = -1;
+    size_t keyCount = 0;
+    std::vector<ValueType> fences;  // first key of every page
+    ValueType maxKey{};
+    mutable Page cache[kCachePages];
+    mutable size_t clock = 0;
+};
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+template <typename ValueType>
+class TieredSet {
+public:
+    //---------------------------------------------------
+    // constructors
+
+    // Run files are created in directory
+    explicit TieredSet(std::string directory);
+
+    TieredSet(const TieredSet&) = delete;
+    TieredSet& operator=(const TieredSet&) = delete;
+
+    //---------------------------------------------------
+    // Methods
+
+    size_t size() const;
+
+    bool empty() const;
+
+    void insert(const ValueType& value);
+
+    void erase(const ValueType& value);
+
+    // Moves the in-memory keys of [lo, hi) to a new run on disk, then
+    // merges the newest runs while the run before them is at most
+    // kTierRatio times their size. Invalidates iterators
+    void spill(const ValueType& lo, const ValueType& hi);
+
+    // Merges every run into one and drops every tombstone
+    void compact();
+
+    size_t run_count() const;
+
+    // Keys currently held in memory, tombstones included
+    size_t memory_size() const;
+
+    //---------------------------------------------------
+    // iterators
+
+    // Merges the in-memory keys with a cursor per run
+    class iterator {
+    public:
+        iterator() = default;
+        iterator(const TieredSet<ValueType>* parent, typename Set<ValueType>::iterator hot,
+                 std::vector<size_t> positions);
+
+        iterator& operator++();      // ++it
+        iterator operator++(int);    // it++
+
+        const ValueType& operator*() const;
+        const ValueType* operator->() const;
+
+        bool operator==(const iterator& other) const;
+        bool operator!=(const iterator& other) const;
+
+    private:
+        // Points current at the smallest live key among the sources
+        void settle();
+
+        const TieredSet<ValueType>* parent = nullptr;
+        typename Set<ValueType>::iterator hot;
+        std::vector<size_t> positions;
+        size_t source = 0;  // run index, runs.size() for the hot set, SIZE_MAX at the end
+        ValueType current{};
+    };
+
+    iterator begin() const;
+
+    iterator end() const;
+
+    //---------------------------------------------------
+    // Search methods
+
+    iterator find(const ValueType& key) const;
+
+    iterator lower_bound(const ValueType& key) const;
+
+    bool contains(const ValueType& key) const;
+
+private:
+    static constexpr size_t kTierRatio = 2;  // keeps about log n runs
+
+    bool inRuns(const ValueType& key) const {
+        for (const auto& run : runs)
+            if (run->contains(key))
+                return true;
+        return false;
+    }
+
+    // Rewrites runs[first..] as one run without their erased keys,
+    // whose tombstones go too
+    void merge(size_t first) {
+        std::vector<size_t> from, to;
+        for (size_t i = 0; i < runs.size(); ++i) {
+            from.push_back(i < first ? runs[i]->size() : 0);
+            to.push_back(runs[i]->size());
+        }
+        std::string path = directory + "/run-" + std::to_string(spilled++) + ".bin";
+        std::unique_ptr<SortedRun<ValueType>> merged(
+            new SortedRun<ValueType>(path, iterator(this, hot.end(), from), iterator(this, hot.end(), to)));
+
+        runs.resize(first);
+        if (merged->size())
+            runs.push_back(std::move(merged));
+        runKeys = 0;
+        for (const auto& run : runs)
+            runKeys += run->size();
+
+        // A tombstone whose key left every run has nothing left to hide
+        auto tx = removed.transaction();
+        for (const ValueType& key : removed)
+            if (!inRuns(key))
+                tx.erase(key);
+        tx.commit();
+    }
+
+    //---------------------------------------------------
+
+    std::string directory;
+    size_t spilled = 0;                     // numbers run files
+    Set<ValueType> hot;                     // keys absent from every run
+    Set<ValueType> removed;                 // tombstones of run keys
+    std::vector<std::unique_ptr<SortedRun<ValueType>>> runs;
+    size_t runKeys = 0;
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType>
+template<typename iteratorType>
+SortedRun<ValueType>::SortedRun(const std::string& path, iteratorType first, iteratorType last) : path(path) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    check(fd >= 0, "open");
+
+    std::vector<ValueType> buffer;
+    buffer.reserve(kPageKeys);
+    try {
+        for (; first != last; ++first) {
+            if (buffer.empty())
+                fences.push_back(*first);
+            buffer.push_back(*first);
+            if (buffer.size() == kPageKeys) {
+                writePage(fences.size() - 1, buffer.data(), buffer.size());
+                buffer.clear();
+            }
+            ++keyCount;
+        }
+        if (!buffer.empty())
+            writePage(fences.size() - 1, buffer.data(), buffer.size());
+    } catch (...) {
+        ::close(fd);
+        ::unlink(path.c_str());
+        throw;
+    }
+    if (keyCount)
+        maxKey = at(keyCount - 1);
+}
+
+template<typename ValueType>
+SortedRun<ValueType>::~SortedRun() {
+    ::close(fd);
+    ::unlink(path.c_str());
+}
+
+template<typename ValueType>
+size_t SortedRun<ValueType>::size() const {
+    return keyCount;
+}
+
+template<typename ValueType>
+ValueType SortedRun<ValueType>::at(size_t index) const {
+    return page(index / kPageKeys).keys[index % kPageKeys];
+}
+
+template<typename ValueType>
+size_t SortedRun<ValueType>::lower_bound(const ValueType& key) const {
+    // Last page whose first key is <= key holds the answer or ends right before it
+    size_t number = std::upper_bound(fences.begin(), fences.end(), key) - fences.begin();
+    if (number == 0)
+        return 0;
+    --number;
+
+    const std::vector<ValueType>& keys = page(number).keys;
+    return number * kPageKeys + (std::lower_bound(keys.begin(), keys.end(), key) - keys.begin());
+}
+
+template<typename ValueType>
+bool SortedRun<ValueType>::contains(const ValueType& key) const {
+    if (!keyCount || key < fences.front() || maxKey < key)
+        return false;
+    size_t index = lower_bound(key);
+    return index < keyCount && !(key < at(index));
+}
+
+template<typename ValueType>
+const ValueType& SortedRun<ValueType>::front() const {
+    return fences.front();
+}
+
+template<typename ValueType>
+const ValueType& SortedRun<ValueType>::back() const {
+    return maxKey;
+}
+
+template<typename ValueType>
+TieredSet<ValueType>::TieredSet(std::string directory) : directory(std::move(directory)) {}
+
+template<typename ValueType>
+size_t TieredSet<ValueType>::size() const {
+    return hot.size() + runKeys - removed.size();
+}
+
+template<typename ValueType>
+bool TieredSet<ValueType>::empty() const {
+    return size() == 0;
+}
+
+template<typename ValueType>
+void TieredSet<ValueType>::insert(const ValueType& value) {
+    if (inRuns(value))
+        removed.erase(value);
+    else
+        hot.insert(value);
+}
+
+template<typename ValueType>
+void TieredSet<ValueType>::erase(const ValueType& value) {
+    if (inRuns(value))
+        removed.insert(value);
+    else
+        hot.erase(value);
+}
+
+template<typename ValueType>
+void TieredSet<ValueType>::spill(const ValueType& lo, const ValueType& hi) {
+    std::vector<ValueType> keys;
+    for (auto it = hot.lower_bound(lo); it != hot.end() && *it < hi; ++it)
+        keys.push_back(*it);
+    if (keys.empty())
+        return;
+
+    std::string path = directory + "/run-" + std::to_string(spilled++) + ".bin";
+    runs.emplace_back(new SortedRun<ValueType>(path, keys.begin(), keys.end()));
+    runKeys += keys.size();
+
+    auto tx = hot.transaction();
+    for (const ValueType& key : keys)
+        tx.erase(key);
+    tx.commit();
+
+    // Run sizes then grow geometrically from the newest, so every
+    // key is rewritten about log n times
+    size_t first = runs.size() - 1, newer = runs[first]->size();
+    while (first > 0 && runs[first - 1]->size() <= kTierRatio * newer)
+        newer += runs[--first]->size();
+    if (first + 1 < runs.size())
+        merge(first);
+}
+
+template<typename ValueType>
+void TieredSet<ValueType>::compact() {
+    if (runs.size() > 1 || (!runs.empty() && !removed.empty()))
+        merge(0);
+}
+
+template<typename ValueType>
+size_t TieredSet<ValueType>::run_count() const {
+    return runs.size();
+}
+
+template<typename ValueType>
+size_t TieredSet<ValueType>::memory_size() const {
+    return hot.size() + removed.size();
+}
+
+template<typename ValueType>
+TieredSet<ValueType>::iterator::iterator(const TieredSet<ValueType>* parent, typename Set<ValueType>::iterator hot,
+                                         std::vector<size_t> positions)
+    : parent(parent), hot(hot), positions(std::move(positions)) {
+    settle();
+}
+
+template<typename ValueType>
+void TieredSet<ValueType>::iterator::settle() {
+    const auto& runs = parent->runs;
+    for (;;) {
+        source = SIZE_MAX;
+        if (hot != parent->hot.end()) {
+            source = runs.size();
+            current = *hot;
+        }
+        for (size_t i = 0; i < runs.size(); ++i) {
+            if (positions[i] == runs[i]->size())
+                continue;
+            ValueType key = runs[i]->at(positions[i]);
+            if (source == SIZE_MAX || key < current) {
+                source = i;
+                current = key;
+            }
+        }
+
+        if (source >= runs.size() || parent->removed.find(current) == parent->removed.end())
+            return;
+        ++positions[source];
+    }
+}
+
+template<typename ValueType>
+typename TieredSet<ValueType>::iterator& TieredSet<ValueType>::iterator::operator++() {
+    if (source == parent->runs.size())
+        ++hot;
+    else
+        ++positions[source];
+    settle();
+    return *this;
+}
+
+template<typename ValueType>
+typename TieredSet<ValueType>::iterator TieredSet<ValueType>::iterator::operator++(int) {
+    iterator old(*this);
+    ++*this;
+    return old;
+}
+
+template<typename ValueType>
+const ValueType& TieredSet<ValueType>::iterator::operator*() const {
+    return current;
+}
+
+template<typename ValueType>
+const ValueType* TieredSet<ValueType>::iterator::operator->() const {
+    return &current;
+}
+
+template<typename ValueType>
+bool TieredSet<ValueType>::iterator::operator==(const iterator& other) const {
+    return this->hot == other.hot && this->positions == other.positions && this->parent == other.parent;
+}
+
+template<typename ValueType>
+bool TieredSet<ValueType>::iterator::operator!=(const iterator& other) const {
+    return !(*this == other);
+}
+
+template<typename ValueType>
+typename TieredSet<ValueType>::iterator TieredSet<ValueType>::begin() const {
+    return iterator(this, hot.begin(), std::vector<size_t>(runs.size(), 0));
+}
+
+template<typename ValueType>
+typename TieredSet<ValueType>::iterator TieredSet<ValueType>::end() const {
+    std::vector<size_t> positions;
+    for (const auto& run : runs)
+        positions.push_back(run->size());
+    return iterator(this, hot.end(), std::move(positions));
+}
+
+template<typename ValueType>
+typename TieredSet<ValueType>::iterator TieredSet<ValueType>::find(const ValueType& key) const {
+    iterator it = lower_bound(key);
+    return it != end() && !(key < *it) ? it : end();
+}
+
+template<typename ValueType>
+typename TieredSet<ValueType>::iterator TieredSet<ValueType>::lower_bound(const ValueType& key) const {
+    std::vector<size_t> positions;
+    for (const auto& run : runs)
+        positions.push_back(run->lower_bound(key));
+    return iterator(this, hot.lower_bound(key), std::move(positions));
+}
+
+template<typename ValueType>
+bool TieredSet<ValueType>::contains(const ValueType& key) const {
+    if (hot.find(key) != hot.end())
+        return true;
+    return removed.find(key) == removed.end() && inRuns(key);
+}
@@ -0,0 +1,96 @@
+/*-------------------------------------------------------
+
+    Unix domain socket helpers
+    Stream sockets bound to a path, shared by the replication
+    and the partitioned set processes
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct UnixSocket {
+    static void check(bool ok, const char* what) {
+        if (!ok)
+            throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    static sockaddr_un address(const std::string& path) {
+        sockaddr_un result = {};
+        result.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(result.sun_path))
+            throw std::invalid_argument("socket path is too long: " + path);
+        std::memcpy(result.sun_path, path.c_str(), path.size() + 1);
+        return result;
+    }
+
+    // Listening socket at path, a stale socket file is replaced
+    static int listen(const std::string& path) {
+        sockaddr_un address = UnixSocket::address(path);
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        check(fd >= 0, "socket");
+
+        ::unlink(path.c_str());
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || ::listen(fd, 16) < 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "bind");
+        }
+        return fd;
+    }
+
+    static int connect(const std::string& path) {
+        sockaddr_un address = UnixSocket::address(path);
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        check(fd >= 0, "socket");
+
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "connect");
+        }
+        return fd;
+    }
+
+    static void setNonBlocking(int fd) {
+        int flags = ::fcntl(fd, F_GETFL);
+        check(flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0, "fcntl");
+    }
+
+    // False once the peer is gone
+    static bool sendAll(int fd, const char* data, size_t size) {
+        while (size) {
+            ssize_t sent = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+                return false;
+            data += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    static bool receiveAll(int fd, char* data, size_t size) {
+        while (size) {
+            ssize_t got = ::recv(fd, data, size, 0);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return false;
+            data += got;
+            size -= got;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,368 @@
+/*-------------------------------------------------------
+
+    Multi-version set with timestamped reads
+    Every key version carries the range of timestamps
+    [begin, end) it is visible in. Writers stamp new versions
+    with a logical clock, readers take a Snapshot and see the
+    set as of its timestamp however long they run. Versions
+    no active snapshot can see are collected
+
+-------------------------------------------------------*/
+
+#pragma once
+
+#include "set.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+
+/*-------------------------------------------------------
+    Key versions
+    A version of key is visible at the timestamps in
+    [begin, end). The Set of versions keeps the least begin
+    and the greatest end of every subtree, so a snapshot
+    leaves out subtrees holding nothing it can see
+-------------------------------------------------------*/
+
+template <typename ValueType>
+struct KeyVersion {
+    ValueType key;
+    uint64_t begin;
+    uint64_t end;  // not part of the order
+
+    bool operator<(const KeyVersion& other) const {
+        if (key < other.key)
+            return true;
+        if (other.key < key)
+            return false;
+        return begin < other.begin;
+    }
+
+    bool visible(uint64_t time) const {
+        return begin <= time && time < end;
+    }
+};
+
+template <typename ValueType>
+struct KeySummary<KeyVersion<ValueType>> {
+    struct Summary {
+        explicit Summary(const KeyVersion<ValueType>& version) : minBegin(version.begin), maxEnd(version.end) {}
+
+        void update(const KeyVersion<ValueType>& version, const Summary* left, const Summary* right) {
+            minBegin = version.begin;
+            maxEnd = version.end;
+            for (const Summary* child : {left, right}) {
+                if (child) {
+                    minBegin = std::min(minBegin, child->minBegin);
+                    maxEnd = std::max(maxEnd, child->maxEnd);
+                }
+            }
+        }
+
+        // No version in the subtree is visible at time
+        bool hides(uint64_t time) const {
+            return time < minBegin || maxEnd <= time;
+        }
+
+        uint64_t minBegin, maxEnd;
+    };
+};
+
+/*-------------------------------------------------------
+    Class declaration
+-------------------------------------------------------*/
+
+// NodeAlignment is passed on to the Set of versions, kCacheLineSize keeps
+// a writer from invalidating lines readers are walking
+template <typename ValueType, size_t NodeAlignment = 0>
+class VersionedSet {
+public:
+    static constexpr uint64_t kForever = UINT64_MAX;
+
+    //---------------------------------------------------
+    // Snapshot
+
+    // Reads as of one timestamp, versions it sees are kept alive while it exists.
+    // Every call locks the set only for its own duration
+    class Snapshot {
+    public:
+        Snapshot(const VersionedSet<ValueType, NodeAlignment>* parent, uint64_t timestamp);
+        Snapshot(Snapshot&& other) noexcept;
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+
+        ~Snapshot();
+
+        uint64_t timestamp() const;
+
+        bool contains(const ValueType& key) const;
+
+        // Stays valid across writers, see KeyCursor
+        using iterator = KeyCursor<Snapshot, ValueType>;
+
+        iterator begin() const;
+
+        iterator end() const;
+
+        iterator find(const ValueType& key) const;
+
+        iterator lower_bound(const ValueType& key) const;
+
+        iterator upper_bound(const ValueType& key) const;
+
+    private:
+        const VersionedSet<ValueType, NodeAlignment>* parent = nullptr;
+        uint64_t time = 0;
+    };
+
+    //---------------------------------------------------
+    // Methods
+
+    VersionedSet() = default;
+    VersionedSet(const VersionedSet&) = delete;
+    VersionedSet& operator=(const VersionedSet&) = delete;
+
+    // Writes return the timestamp they became visible at
+    uint64_t insert(const ValueType& value);
+
+    uint64_t erase(const ValueType& value);
+
+    // Timestamp of the latest write
+    uint64_t now() const;
+
+    Snapshot snapshot() const;
+
+    // Snapshot of an earlier moment, versions older than the
+    // oldest active snapshot may already be gone
+    Snapshot snapshot_at(uint64_t timestamp) const;
+
+    // Drops versions that ended before every active snapshot began,
+    // also done automatically as they pile up
+    void collect();
+
+    // Stored versions, live and dead
+    size_t versions() const;
+
+private:
+    using Version = KeyVersion<ValueType>;
+    using VersionIterator = typename Set<Version, NodeAlignment>::iterator;
+
+    static bool sameKey(const ValueType& a, const ValueType& b) {
+        return !(a < b) && !(b < a);
+    }
+
+    // Latest version of key, the caller holds the lock
+    VersionIterator latest(const ValueType& key) const {
+        VersionIterator it = entries.lower_bound(Version{key, kForever, kForever});
+        if (it == entries.begin())
+            return entries.end();
+        --it;
+        return sameKey(it->key, key) ? it : entries.end();
+    }
+
+    // Version of key visible at time, the last one begun by then;
+    // the caller holds the lock
+    const ValueType* visibleAt(const ValueType& key, uint64_t time) const {
+        VersionIterator it = entries.lower_bound(Version{key, time + 1, 0});
+        if (it == entries.begin())
+            return nullptr;
+        --it;
+        return sameKey(it->key, key) && it->visible(time) ? &it->key : nullptr;
+    }
+
+    // First version visible at time whose key is not less than key, or
+    // greater than key when strict, the least one for nullptr. Subtrees
+    // without a version visible at time are skipped; the caller holds the lock
+    const ValueType* seek(const ValueType* key, bool strict, uint64_t time) const {
+        auto hidden = [time](const typename KeySummary<Version>::Summary& summary) {
+            return summary.hides(time);
+        };
+        auto visible = [time](const Version& version) {
+            return version.visible(time);
+        };
+        VersionIterator it = key ? entries.find_first(Version{*key, strict ? kForever : 0, 0}, hidden, visible)
+                                 : entries.find_first(hidden, visible);
+        return it != entries.end() ? &it->key : nullptr;
+    }
+
+    uint64_t oldestReader() const {
+        std::lock_guard<std::mutex> guard(readersMutex);
+        return readers.empty() ? clock.load() : readers.begin()->first;
+    }
+
+    void addReader(uint64_t time) const {
+        std::lock_guard<std::mutex> guard(readersMutex);
+        ++readers[time];
+    }
+
+    void removeReader(uint64_t time) const {
+        std::lock_guard<std::mutex> guard(readersMutex);
+        auto it = readers.find(time);
+        if (--it->second == 0)
+            readers.erase(it);
+    }
+
+    void collectIfNeeded() {
+        if (ended >= collectAt)
+            collectLocked();
+    }
+
+    // A pass walks every entry, so the next one waits for a share of
+    // the entries to end, counted on top of the versions pinned by
+    // long readers that survived this one
+    void collectLocked() {
+        uint64_t horizon = oldestReader();
+        auto tx = entries.transaction();
+        size_t dropped = 0;
+        for (const Version& version : entries) {
+            if (version.end <= horizon) {
+                tx.erase(version);
+                ++dropped;
+            }
+        }
+        tx.commit();
+        ended -= dropped;
+        collectAt = ended + std::max(kMinGarbage, entries.size() / kGarbageShare);
+    }
+
+    //---------------------------------------------------
+
+    static constexpr size_t kMinGarbage = 1024;
+    static constexpr size_t kGarbageShare = 4;
+
+    Set<Version, NodeAlignment> entries;
+    size_t ended = 0;  // versions with a finite end
+    size_t collectAt = kMinGarbage;
+    std::atomic<uint64_t> clock{0};
+    alignas(kCacheLineSize) mutable std::shared_mutex mutex;
+
+    // Snapshots come and go under their own lock, on its own cache line
+    alignas(kCacheLineSize) mutable std::mutex readersMutex;
+    mutable std::map<uint64_t, size_t> readers;  // snapshot timestamp -> count
+};
+
+/*-------------------------------------------------------
+    Implementation
+-------------------------------------------------------*/
+
+template<typename ValueType, size_t NodeAlignment>
+uint64_t VersionedSet<ValueType, NodeAlignment>::insert(const ValueType& value) {
+    std::unique_lock<std::shared_mutex> guard(mutex);
+    VersionIterator it = latest(value);
+    if (it != entries.end() && it->end == kForever)
+        return clock.load();
+
+    uint64_t time = clock.load() + 1;
+    entries.insert(Version{value, time, kForever});
+    clock.store(time);
+    return time;
+}
+
+template<typename ValueType, size_t NodeAlignment>
+uint64_t VersionedSet<ValueType, NodeAlignment>::erase(const ValueType& value) {
+    std::unique_lock<std::shared_mutex> guard(mutex);
+    VersionIterator it = latest(value);
+    if (it == entries.end() || it->end != kForever)
+        return clock.load();
+
+    // Replaced rather than changed in place, so the subtree summaries follow
+    uint64_t time = clock.load() + 1;
+    Version ending = *it;
+    ending.end = time;
+    entries.erase(ending);
+    entries.insert(ending);
+    ++ended;
+    clock.store(time);
+    collectIfNeeded();
+    return time;
+}
+
+template<typename ValueType, size_t NodeAlignment>
+uint64_t VersionedSet<ValueType, NodeAlignment>::now() const {
+    return clock.load();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename VersionedSet<ValueType, NodeAlignment>::Snapshot VersionedSet<ValueType, NodeAlignment>::snapshot() const {
+    // Registered under the lock so that no collection slips in between
+    std::shared_lock<std::shared_mutex> guard(mutex);
+    return Snapshot(this, clock.load());
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename VersionedSet<ValueType, NodeAlignment>::Snapshot VersionedSet<ValueType, NodeAlignment>::snapshot_at(uint64_t timestamp) const {
+    std::shared_lock<std::shared_mutex> guard(mutex);
+    return Snapshot(this, std::min(timestamp, clock.load()));
+}
+
+template<typename ValueType, size_t NodeAlignment>
+void VersionedSet<ValueType, NodeAlignment>::collect() {
+    std::unique_lock<std::shared_mutex> guard(mutex);
+    collectLocked();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+size_t VersionedSet<ValueType, NodeAlignment>::versions() const {
+    std::shared_lock<std::shared_mutex> guard(mutex);
+    return entries.size();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+VersionedSet<ValueType, NodeAlignment>::Snapshot::Snapshot(const VersionedSet<ValueType, NodeAlignment>* parent, uint64_t timestamp)
+    : parent(parent), time(timestamp) {
+    parent->addReader(time);
+}
+
+template<typename ValueType, size_t NodeAlignment>
+VersionedSet<ValueType, NodeAlignment>::Snapshot::Snapshot(Snapshot&& other) noexcept : parent(other.parent), time(other.time) {
+    other.parent = nullptr;
+}
+
+template<typename ValueType, size_t NodeAlignment>
+VersionedSet<ValueType, NodeAlignment>::Snapshot::~Snapshot() {
+    if (parent)
+        parent->removeReader(time);
+}
+
+template<typename ValueType, size_t NodeAlignment>
+uint64_t VersionedSet<ValueType, NodeAlignment>::Snapshot::timestamp() const {
+    return time;
+}
+
+template<typename ValueType, size_t NodeAlignment>
+bool VersionedSet<ValueType, NodeAlignment>::Snapshot::contains(const ValueType& key) const {
+    return find(key) != end();
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename VersionedSet<ValueType, NodeAlignment>::Snapshot::iterator VersionedSet<ValueType, NodeAlignment>::Snapshot::begin() const {
+    std::shared_lock<std::shared_mutex> guard(parent->mutex);
+    return iterator(this, parent->seek(nullptr, false, time));
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename VersionedSet<ValueType, NodeAlignment>::Snapshot::iterator VersionedSet<ValueType, NodeAlignment>::Snapshot::end() const {
+    return iterator(this, nullptr);
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename VersionedSet<ValueType, NodeAlignment>::Snapshot::iterator VersionedSet<ValueType, NodeAlignment>::Snapshot::find(const ValueType& key) const {
+    std::shared_lock<std::shared_mutex> guard(parent->mutex);
+    return iterator(this, parent->visibleAt(key, time));
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename VersionedSet<ValueType, NodeAlignment>::Snapshot::iterator VersionedSet<ValueType, NodeAlignment>::Snapshot::lower_bound(const ValueType& key) const {
+    std::shared_lock<std::shared_mutex> guard(parent->mutex);
+    return iterator(this, parent->seek(&key, false, time));
+}
+
+template<typename ValueType, size_t NodeAlignment>
+typename VersionedSet<ValueType, NodeAlignment>::Snapshot::iterator VersionedSet<ValueType, NodeAlignment>::Snapshot::upper_bound(const ValueType& key) const {
+    std::shared_lock<std::shared_mutex> guard(parent->mutex);
+    return iterator(this, parent->seek(&key, true, time));
+}